@@ -0,0 +1,826 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Archive views: the members of a zip or tar archive are listed from its
+ * index, read with range requests through the block cache, and served one
+ * by one. Only the zip central directory (or the tar headers) and the
+ * members actually read are transferred.
+ *
+ * Deflated zip members are inflated on the fly. The inflate state is kept
+ * between reads, so sequential reads of a member continue where the last
+ * one stopped -- seeking backwards restarts from the member's beginning.
+ * Encrypted zip members are listed but can't be read.
+ *
+ * Tar headers are spread over the whole archive. They are read through a
+ * window fetched with a single request, which doubles while headers keep
+ * falling close past it (small members) and starts small again after a
+ * jump over a large member.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "cache.h"
+#include "lionfs.h"
+#include "mem.h"
+
+#define ZIP_EOCD_SIG       0x06054b50
+#define ZIP_EOCD64_LOC_SIG 0x07064b50
+#define ZIP_EOCD64_SIG     0x06064b50
+#define ZIP_CENTRAL_SIG    0x02014b50
+#define ZIP_LOCAL_SIG      0x04034b50
+
+#define ZIP_EOCD_SIZE 22
+#define ZIP_MAX_COMMENT 65535
+
+#define ZIP_STORED   0
+#define ZIP_DEFLATED 8
+
+#define ZIP_ENCRYPTED 0x0001 /* general purpose flag */
+
+#define TAR_BLOCK 512
+
+/* limits of the window tar headers are read through */
+#define TAR_SPAN_MIN (256 * 1024)
+#define TAR_SPAN_MAX (4 * 1024 * 1024)
+
+/* compressed bytes read at a time when inflating */
+#define INFLATE_CHUNK (64 * 1024)
+
+struct inflater {
+	z_stream zs;
+	long long in;  /* compressed bytes read */
+	long long pos; /* uncompressed bytes produced */
+	unsigned char buf[INFLATE_CHUNK];
+};
+
+struct member {
+	char *name; /* path in the archive, without a trailing '/' */
+	int is_dir;
+	int method;
+	int encrypted;
+	long long header; /* zip local header, -1 once `data` is known */
+	long long data;   /* offset of the member's data in the archive */
+	long long csize;
+	long long size;
+	time_t mtime;
+	pthread_mutex_t lock;
+	struct inflater *z;
+};
+
+struct archive {
+	struct member *members; /* sorted by name */
+	size_t n;
+	size_t charged; /* to MEM_LINKS */
+};
+
+static unsigned int
+le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned long
+le32(const unsigned char *p)
+{
+	return le16(p) | (unsigned long) le16(p + 2) << 16;
+}
+
+static unsigned long long
+le64(const unsigned char *p)
+{
+	return le32(p) | (unsigned long long) le32(p + 4) << 32;
+}
+
+/* read exactly `size` bytes of the archive at `off` -- return 0 if so */
+static int
+read_at(struct lionfile *file, long long off, size_t size, void *buf)
+{
+	if (off < 0 || off + (long long) size > file->size)
+		return -1;
+
+	return cache_read(file, buf, size, off) == size ? 0 : -1;
+}
+
+static int
+cmp_member(const void *a, const void *b)
+{
+	return strcmp(((const struct member*) a)->name,
+		      ((const struct member*) b)->name);
+}
+
+/* add a member named `name` (`len` bytes), return it or NULL */
+static struct member*
+add_member(struct archive *ar, size_t *size, const char *name, size_t len)
+{
+	struct member *m;
+
+	/* "./dir/" is "dir" */
+	while (len >= 2 && strncmp(name, "./", 2) == 0) {
+		name += 2;
+		len -= 2;
+	}
+	while (len && name[0] == '/') {
+		name++;
+		len--;
+	}
+
+	if (ar->n == *size) {
+		*size = *size ? *size * 2 : 64;
+		if ((m = realloc(ar->members, *size * sizeof(*m))) == NULL)
+			return NULL;
+		ar->members = m;
+	}
+
+	m = &ar->members[ar->n];
+	memset(m, 0, sizeof(*m));
+	m->header = -1;
+
+	if (len && name[len - 1] == '/') {
+		m->is_dir = 1;
+		len--;
+	}
+	if (len == 0 || (m->name = strndup(name, len)) == NULL)
+		return NULL;
+
+	ar->n++;
+	return m;
+}
+
+static time_t
+dos_time(unsigned int time, unsigned int date)
+{
+	struct tm tm = {
+		.tm_sec = (time & 0x1f) * 2,
+		.tm_min = (time >> 5) & 0x3f,
+		.tm_hour = time >> 11,
+		.tm_mday = date & 0x1f,
+		.tm_mon = ((date >> 5) & 0xf) - 1,
+		.tm_year = (date >> 9) + 80,
+		.tm_isdst = -1,
+	};
+
+	return mktime(&tm);
+}
+
+/* find the end of central directory, zip64 if needed */
+static int
+zip_find_directory(struct lionfile *file, long long *cd_off,
+		   long long *cd_size, long long *count)
+{
+	unsigned char *buf, *p, rec[56];
+	size_t tail;
+	int ret = -1;
+
+	tail = ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;
+	if ((long long) tail > file->size)
+		tail = file->size;
+	if (tail < ZIP_EOCD_SIZE || (buf = malloc(tail)) == NULL)
+		return -1;
+	if (read_at(file, file->size - tail, tail, buf))
+		goto out;
+
+	for (p = buf + tail - ZIP_EOCD_SIZE; p >= buf; p--)
+		if (le32(p) == ZIP_EOCD_SIG)
+			break;
+	if (p < buf)
+		goto out;
+
+	*count = le16(p + 10);
+	*cd_size = le32(p + 12);
+	*cd_off = le32(p + 16);
+
+	if (p - buf >= 20 && le32(p - 20) == ZIP_EOCD64_LOC_SIG) {
+		if (read_at(file, le64(p - 20 + 8), sizeof(rec), rec) ||
+		    le32(rec) != ZIP_EOCD64_SIG)
+			goto out;
+		*count = le64(rec + 32);
+		*cd_size = le64(rec + 40);
+		*cd_off = le64(rec + 48);
+	}
+
+	if (*cd_off >= 0 && *cd_size >= 0 && *cd_off + *cd_size <= file->size)
+		ret = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+static int
+zip_open(struct lionfile *file, struct archive *ar, size_t *size)
+{
+	long long cd_off, cd_size, count, i;
+	unsigned char *cd, *p, *end, *extra;
+	unsigned int nlen, xlen, clen, id, len;
+	struct member *m;
+	int ret = -1;
+
+	if (zip_find_directory(file, &cd_off, &cd_size, &count))
+		return -1;
+
+	mem_charge(MEM_INFLIGHT, cd_size);
+	if ((cd = malloc(cd_size)) == NULL)
+		goto out;
+	if (read_at(file, cd_off, cd_size, cd))
+		goto out;
+
+	end = cd + cd_size;
+	for (p = cd, i = 0; i < count; i++) {
+		if (end - p < 46 || le32(p) != ZIP_CENTRAL_SIG)
+			goto out;
+		nlen = le16(p + 28);
+		xlen = le16(p + 30);
+		clen = le16(p + 32);
+		if (end - p < 46 + nlen + xlen + clen)
+			goto out;
+
+		if ((m = add_member(ar, size, (char*) p + 46, nlen)) == NULL) {
+			p += 46 + nlen + xlen + clen;
+			continue;
+		}
+		m->encrypted = le16(p + 8) & ZIP_ENCRYPTED;
+		m->method = le16(p + 10);
+		m->mtime = dos_time(le16(p + 12), le16(p + 14));
+		m->csize = le32(p + 20);
+		m->size = le32(p + 24);
+		m->header = le32(p + 42);
+
+		/* zip64 extended information replaces saturated fields */
+		for (extra = p + 46 + nlen; extra + 4 <= p + 46 + nlen + xlen;
+		     extra += 4 + len) {
+			id = le16(extra);
+			len = le16(extra + 2);
+			if (id != 0x0001)
+				continue;
+
+			unsigned char *e = extra + 4;
+			if (m->size == 0xffffffff && e + 8 <= extra + 4 + len) {
+				m->size = le64(e);
+				e += 8;
+			}
+			if (m->csize == 0xffffffff && e + 8 <= extra + 4 + len) {
+				m->csize = le64(e);
+				e += 8;
+			}
+			if (m->header == 0xffffffff && e + 8 <= extra + 4 + len)
+				m->header = le64(e);
+		}
+
+		p += 46 + nlen + xlen + clen;
+	}
+
+	ret = 0;
+
+out:
+	free(cd);
+	mem_uncharge(MEM_INFLIGHT, cd_size);
+	return ret;
+}
+
+static long long
+tar_number(const char *field, size_t len)
+{
+	long long n = 0;
+
+	/* GNU base-256 for large values */
+	if (*field & 0x80) {
+		n = *field & 0x3f;
+		while (--len)
+			n = n << 8 | (unsigned char) *++field;
+		return n;
+	}
+
+	for (; len && (*field == ' ' || *field == '\0'); field++, len--)
+		;
+	for (; len && *field >= '0' && *field <= '7'; field++, len--)
+		n = n * 8 + (*field - '0');
+
+	return n;
+}
+
+static int
+tar_checksum_ok(const unsigned char *hdr)
+{
+	long long sum = 0;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+	return sum == tar_number((const char*) hdr + 148, 8);
+}
+
+/*
+ * find `key` in pax extended header records ("<len> <key>=<value>\n"),
+ * return its value or NULL
+ */
+static char*
+pax_record(const char *data, size_t size, const char *key)
+{
+	const char *p = data, *end = data + size, *value;
+	size_t klen = strlen(key);
+	long len;
+
+	while (p < end && (len = strtol(p, NULL, 10)) > 0 && p + len <= end) {
+		value = memchr(p, ' ', len);
+		if (value && strncmp(value + 1, key, klen) == 0 &&
+		    value[1 + klen] == '=') {
+			value += 2 + klen;
+			return strndup(value, p + len - value - 1);
+		}
+		p += len;
+	}
+
+	return NULL;
+}
+
+/* window of the archive tar headers are read through */
+struct tar_window {
+	unsigned char *buf;
+	long long off;
+	size_t len;
+	size_t span; /* bytes fetched next time */
+};
+
+/* copy `size` bytes of the archive at `off`, return 0 if all were there */
+static int
+tar_read(struct lionfile *file, struct tar_window *w, long long off,
+	 size_t size, void *dst)
+{
+	unsigned char *buf;
+	size_t len;
+
+	if (off >= w->off && off + (long long) size <= w->off + (long long) w->len)
+		goto copy;
+
+	/* the next header less than a span past the window: members are small */
+	if (w->len && off >= w->off + (long long) w->len &&
+	    off < w->off + (long long) (w->len + w->span))
+		w->span = w->span * 2 < TAR_SPAN_MAX ? w->span * 2 : TAR_SPAN_MAX;
+	else
+		w->span = TAR_SPAN_MIN;
+
+	len = w->span > size ? w->span : size;
+	if (off + (long long) len > file->size)
+		len = file->size - off;
+	if (off < 0 || len < size)
+		return -1;
+
+	mem_charge(MEM_INFLIGHT, len);
+	if ((buf = malloc(len)) == NULL || read_at(file, off, len, buf)) {
+		free(buf);
+		mem_uncharge(MEM_INFLIGHT, len);
+		return -1;
+	}
+	free(w->buf);
+	mem_uncharge(MEM_INFLIGHT, w->len);
+	w->buf = buf;
+	w->off = off;
+	w->len = len;
+
+copy:
+	memcpy(dst, w->buf + (off - w->off), size);
+	return 0;
+}
+
+static int
+tar_open(struct lionfile *file, struct archive *ar, size_t *size)
+{
+	struct tar_window w = { .buf = NULL };
+	unsigned char hdr[TAR_BLOCK];
+	char name[256 + 1], *longname = NULL, *data, *value;
+	long long off = 0, len, paxsize = -1;
+	struct member *m;
+	int type, ret = -1;
+
+	if (tar_read(file, &w, 0, TAR_BLOCK, hdr) ||
+	    strncmp((char*) hdr + 257, "ustar", 5) != 0 || !tar_checksum_ok(hdr))
+		goto out;
+
+	while (off + TAR_BLOCK <= file->size) {
+		if (tar_read(file, &w, off, TAR_BLOCK, hdr) || hdr[0] == '\0' ||
+		    !tar_checksum_ok(hdr))
+			break;
+
+		len = tar_number((char*) hdr + 124, 12);
+		type = hdr[156];
+
+		/* the size of a pax header applies to the entry after it */
+		if (type != 'x' && type != 'L' && paxsize >= 0) {
+			len = paxsize;
+			paxsize = -1;
+		}
+
+		/* long names (and pax sizes) come in an entry of their own */
+		if (type == 'L' || type == 'x') {
+			if (len > 65536 || (data = malloc(len + 1)) == NULL ||
+			    tar_read(file, &w, off + TAR_BLOCK, len, data)) {
+				free(longname);
+				goto out;
+			}
+			data[len] = '\0';
+			free(longname);
+			if (type == 'L') {
+				longname = strdup(data);
+			} else {
+				longname = pax_record(data, len, "path");
+				/* ustar sizes stop at 8G */
+				if ((value = pax_record(data, len, "size"))) {
+					paxsize = strtoll(value, NULL, 10);
+					free(value);
+				}
+			}
+			free(data);
+		} else if (type == '0' || type == '\0' || type == '7' ||
+			   type == '5') {
+			if (longname) {
+				snprintf(name, sizeof(name), "%s", longname);
+			} else if (hdr[345]) {
+				snprintf(name, sizeof(name), "%.155s/%.100s",
+					 (char*) hdr + 345, (char*) hdr);
+			} else {
+				snprintf(name, sizeof(name), "%.100s",
+					 (char*) hdr);
+			}
+
+			if ((m = add_member(ar, size, name, strlen(name)))) {
+				m->is_dir |= type == '5';
+				m->method = ZIP_STORED;
+				m->data = off + TAR_BLOCK;
+				m->csize = m->size = m->is_dir ? 0 : len;
+				m->mtime = tar_number((char*) hdr + 136, 12);
+			}
+			free(longname);
+			longname = NULL;
+		}
+
+		off += TAR_BLOCK + (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+	ret = 0;
+
+out:
+	free(longname);
+	free(w.buf);
+	mem_uncharge(MEM_INFLIGHT, w.len);
+	return ret;
+}
+
+static void
+clear_members(struct archive *ar)
+{
+	while (ar->n)
+		free(ar->members[--ar->n].name);
+}
+
+/**
+ * archive_open() Read the index of the zip or tar archive `file` links to.
+ * Return NULL if it isn't one.
+ */
+struct archive*
+archive_open(struct lionfile *file)
+{
+	struct archive *ar;
+	size_t size = 0, i;
+
+	if ((ar = calloc(1, sizeof(struct archive))) == NULL)
+		return NULL;
+
+	if (zip_open(file, ar, &size)) {
+		clear_members(ar);
+		if (tar_open(file, ar, &size))
+			goto error;
+	}
+	if (ar->n == 0)
+		goto error;
+
+	qsort(ar->members, ar->n, sizeof(struct member), cmp_member);
+
+	ar->charged = sizeof(struct archive) + size * sizeof(struct member);
+	for (i = 0; i < ar->n; i++) {
+		pthread_mutex_init(&ar->members[i].lock, NULL);
+		ar->charged += strlen(ar->members[i].name) + 1;
+	}
+	if (mem_charge(MEM_LINKS, ar->charged)) {
+		ar->charged = 0;
+		goto error;
+	}
+
+	return ar;
+
+error:
+	archive_free(ar);
+	return NULL;
+}
+
+void
+archive_free(struct archive *ar)
+{
+	size_t i;
+
+	for (i = 0; i < ar->n; i++) {
+		if (ar->members[i].z) {
+			inflateEnd(&ar->members[i].z->zs);
+			free(ar->members[i].z);
+			mem_uncharge(MEM_INFLIGHT, sizeof(struct inflater));
+		}
+	}
+	clear_members(ar);
+	if (ar->charged)
+		mem_uncharge(MEM_LINKS, ar->charged);
+	free(ar->members);
+	free(ar);
+}
+
+/* index of the first member whose name is not before `name` */
+static size_t
+lower_bound(struct archive *ar, const char *name)
+{
+	size_t lo = 0, hi = ar->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp(ar->members[mid].name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * *`path` is relative to the archive ("" is its root)
+ * return the member at `path`, or NULL -- `is_dir` tells whether path is a
+ * directory, even one with no member of its own
+ */
+static struct member*
+lookup(struct archive *ar, const char *path, int *is_dir)
+{
+	char prefix[strlen(path) + 2];
+	size_t i;
+
+	*is_dir = 0;
+	if (*path == '\0') {
+		*is_dir = 1;
+		return NULL;
+	}
+
+	i = lower_bound(ar, path);
+	if (i < ar->n && strcmp(ar->members[i].name, path) == 0) {
+		*is_dir = ar->members[i].is_dir;
+		return &ar->members[i];
+	}
+
+	/* directories may only exist as the prefix of other members */
+	snprintf(prefix, sizeof(prefix), "%s/", path);
+	i = lower_bound(ar, prefix);
+	*is_dir = i < ar->n &&
+		  strncmp(ar->members[i].name, prefix, strlen(prefix)) == 0;
+
+	return NULL;
+}
+
+int
+archive_getattr(struct archive *ar, const char *path, struct stat *buf)
+{
+	struct member *m;
+	int is_dir;
+
+	m = lookup(ar, path, &is_dir);
+	if (!m && !is_dir)
+		return -ENOENT;
+
+	/* archives are read-only, as fakefiles */
+	buf->st_mode = (is_dir ? S_IFDIR : S_IFREG) | 0444;
+	buf->st_nlink = is_dir ? 2 : 1;
+	if (m) {
+		buf->st_mtime = m->mtime;
+		buf->st_size = m->size;
+	}
+
+	return 0;
+}
+
+/*
+ * entries are paged as in lion_readdir(): each one is given the index of the
+ * next member to look at plus 3
+ */
+int
+archive_readdir(struct archive *ar, const char *path, void *buf,
+		fuse_fill_dir_t filler, off_t off)
+{
+	char prefix[strlen(path) + 2], *name;
+	size_t plen, len, i;
+	int is_dir;
+
+	lookup(ar, path, &is_dir);
+	if (!is_dir)
+		return -ENOTDIR;
+
+	plen = snprintf(prefix, sizeof(prefix), *path ? "%s/" : "%s", path);
+
+	i = lower_bound(ar, prefix);
+	if (off >= 3 && (size_t) off - 3 > i)
+		i = off - 3;
+
+	for (; i < ar->n && strncmp(ar->members[i].name, prefix, plen) == 0;
+	     i++) {
+		name = ar->members[i].name + plen;
+		len = strcspn(name, "/");
+
+		/*
+		 * a child with members under it is listed at the first of
+		 * them, unless it is a member itself
+		 */
+		if (name[len] == '/') {
+			char dir[plen + len + 1];
+			int dummy;
+
+			if (i > 0 && strncmp(ar->members[i - 1].name,
+					     ar->members[i].name,
+					     plen + len + 1) == 0)
+				continue;
+			memcpy(dir, ar->members[i].name, plen + len);
+			dir[plen + len] = '\0';
+			if (lookup(ar, dir, &dummy) != NULL)
+				continue;
+		}
+
+		char child[len + 1];
+		memcpy(child, name, len);
+		child[len] = '\0';
+		if (filler(buf, child, NULL, i + 1 + 3))
+			break;
+	}
+
+	return 0;
+}
+
+/* find where the data of a zip member starts */
+static int
+locate_data(struct lionfile *file, struct member *m)
+{
+	unsigned char hdr[30];
+
+	if (m->header < 0)
+		return 0;
+
+	if (read_at(file, m->header, sizeof(hdr), hdr) ||
+	    le32(hdr) != ZIP_LOCAL_SIG)
+		return -1;
+
+	m->data = m->header + sizeof(hdr) + le16(hdr + 26) + le16(hdr + 28);
+	m->header = -1;
+
+	return 0;
+}
+
+/* *assume member lock is held */
+static int
+reset_inflater(struct member *m)
+{
+	if (m->z) {
+		inflateEnd(&m->z->zs);
+	} else {
+		mem_charge(MEM_INFLIGHT, sizeof(struct inflater));
+		if ((m->z = malloc(sizeof(struct inflater))) == NULL) {
+			mem_uncharge(MEM_INFLIGHT, sizeof(struct inflater));
+			return -1;
+		}
+	}
+
+	memset(&m->z->zs, 0, sizeof(z_stream));
+	m->z->in = 0;
+	m->z->pos = 0;
+
+	/* raw deflate, zip has no zlib header */
+	if (inflateInit2(&m->z->zs, -MAX_WBITS) != Z_OK) {
+		free(m->z);
+		m->z = NULL;
+		mem_uncharge(MEM_INFLIGHT, sizeof(struct inflater));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* *assume member lock is held */
+static int
+inflate_member(struct lionfile *file, struct member *m, char *buf,
+	       size_t size, off_t off)
+{
+	unsigned char skip[16 * 1024];
+	struct inflater *z;
+	size_t avail, n;
+	int ret;
+
+	if ((!m->z || off < m->z->pos) && reset_inflater(m))
+		return -EIO;
+	z = m->z;
+
+	while (z->pos < off + (long long) size) {
+		if (z->zs.avail_in == 0) {
+			n = m->csize - z->in < INFLATE_CHUNK ? m->csize - z->in
+							     : INFLATE_CHUNK;
+			if (n == 0 || read_at(file, m->data + z->in, n, z->buf))
+				break;
+			z->in += n;
+			z->zs.next_in = z->buf;
+			z->zs.avail_in = n;
+		}
+
+		/* inflate into `skip` what comes before `off` */
+		if (z->pos < off) {
+			avail = off - z->pos < (long long) sizeof(skip)
+				? off - z->pos : (long long) sizeof(skip);
+			z->zs.next_out = skip;
+		} else {
+			avail = off + size - z->pos;
+			z->zs.next_out = (unsigned char*) buf + (z->pos - off);
+		}
+		z->zs.avail_out = avail;
+
+		ret = inflate(&z->zs, Z_NO_FLUSH);
+		z->pos += avail - z->zs.avail_out;
+
+		if (ret == Z_STREAM_END)
+			break;
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			reset_inflater(m);
+			return -EIO;
+		}
+	}
+
+	return z->pos > off ? z->pos - off : 0;
+}
+
+/**
+ * archive_read() Read a member of the archive `file` links to. Return the
+ * number of bytes read or -errno.
+ */
+int
+archive_read(struct lionfile *file, const char *path, char *buf, size_t size,
+	     off_t off)
+{
+	struct member *m;
+	int is_dir, ret;
+
+	if ((m = lookup(file->archive, path, &is_dir)) == NULL || is_dir)
+		return is_dir ? -EISDIR : -ENOENT;
+
+	if (off >= m->size)
+		return 0;
+	if (off + (long long) size > m->size)
+		size = m->size - off;
+
+	if (m->encrypted)
+		return -EACCES;
+
+	pthread_mutex_lock(&m->lock);
+
+	if (locate_data(file, m)) {
+		pthread_mutex_unlock(&m->lock);
+		return -EIO;
+	}
+
+	/* only the inflate state needs the lock */
+	if (m->method == ZIP_DEFLATED) {
+		ret = inflate_member(file, m, buf, size, off);
+		pthread_mutex_unlock(&m->lock);
+		return ret;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	if (m->method != ZIP_STORED)
+		return -EOPNOTSUPP;
+
+	return read_at(file, m->data + off, size, buf) ? -EIO : (int) size;
+}
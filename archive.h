@@ -0,0 +1,36 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+struct archive;
+struct lionfile;
+
+struct archive*
+archive_open(struct lionfile*);
+
+void
+archive_free(struct archive*);
+
+int
+archive_getattr(struct archive*, const char*, struct stat*);
+
+int
+archive_readdir(struct archive*, const char*, void*, fuse_fill_dir_t, off_t);
+
+int
+archive_read(struct lionfile*, const char*, char*, size_t, off_t);
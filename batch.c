@@ -0,0 +1,348 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Batching of small reads.
+ *
+ * A small read of a URL other reads of which are in flight opens a batch
+ * and waits up to the batch window for more reads of the same URL close to
+ * it -- concurrent readers of a file tend to keep coming. A read of a URL
+ * with nothing else in flight goes out at once, so a lone reader never
+ * pays the window. Reads separated by less than BATCH_GAP bytes are merged
+ * into one spanning range; the remaining ranges go out as one multi-range
+ * request when the module supports it, or one request each otherwise.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "buf.h"
+#include "linked_list.h"
+#include "modules/common.h"
+#include "network.h"
+
+/* reads larger than this are not worth delaying */
+#define BATCH_MAX_READ (128 * 1024)
+
+/* largest gap between two reads fetched as a single range */
+#define BATCH_GAP (32 * 1024)
+
+/* limits of a single batch */
+#define BATCH_MAX_READS 64
+#define BATCH_MAX_SPAN (8 * 1024 * 1024)
+
+struct read {
+	struct list_head entry;
+	struct list_head flight; /* in `inflight` until it's answered */
+	char *url;
+	long long off;
+	size_t size;
+	void *data;
+	size_t ret;
+};
+
+struct batch {
+	struct list_head entry; /* in `batches` while collecting reads */
+	struct nmodule *module;
+	char *url;
+	struct list_head reads;
+	int nreads;
+	int refs;
+	int done;
+	long long lo, hi; /* span of the reads */
+	pthread_cond_t cond;
+};
+
+/* a range actually requested, covering one or more reads */
+struct segment {
+	struct lion_range range;
+	size_t ret;
+};
+
+static struct list_head batches;
+static struct list_head inflight; /* small reads, batched or not */
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* in microseconds, 0 disables batching */
+static int batch_window = 200;
+
+static int
+cmp_read(const void *a, const void *b)
+{
+	const struct read *x = *(struct read* const*) a;
+	const struct read *y = *(struct read* const*) b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static void
+fetch_segments(struct nmodule *module, char *url, struct segment *segs,
+	       int nsegs)
+{
+	struct lion_range ranges[nsegs];
+	int i;
+
+	if (nsegs > 1) {
+		for (i = 0; i < nsegs; i++)
+			ranges[i] = segs[i].range;
+
+		if (network_get_ranges(module, url, ranges, nsegs) == 0) {
+			for (i = 0; i < nsegs; i++)
+				segs[i].ret = segs[i].range.size;
+			return;
+		}
+	}
+
+	/* one range, or the module can't do multi-range requests */
+	for (i = 0; i < nsegs; i++)
+		segs[i].ret = network_get_data(module, url, segs[i].range.size,
+					       segs[i].range.off,
+					       segs[i].range.data);
+}
+
+/* *assume batch is no longer in `batches`, so its reads can't change */
+static void
+run_batch(struct batch *b)
+{
+	struct read *reads[BATCH_MAX_READS], *r;
+	struct segment segs[BATCH_MAX_READS];
+	long long end;
+	int i, j, n = 0, nsegs = 0;
+
+	list_for_each_entry(r, &b->reads, entry)
+		reads[n++] = r;
+
+	if (n == 1) {
+		r = reads[0];
+		r->ret = network_get_data(b->module, b->url, r->size, r->off,
+					  r->data);
+		return;
+	}
+
+	qsort(reads, n, sizeof(struct read*), cmp_read);
+
+	/* merge reads into segments */
+	for (i = 0; i < n; i++) {
+		end = reads[i]->off + reads[i]->size;
+
+		if (nsegs && reads[i]->off <=
+		    segs[nsegs - 1].range.off + (long long) segs[nsegs - 1].range.size
+		    + BATCH_GAP) {
+			struct lion_range *last = &segs[nsegs - 1].range;
+
+			if (end > last->off + (long long) last->size)
+				last->size = end - last->off;
+			continue;
+		}
+
+		segs[nsegs].range.off = reads[i]->off;
+		segs[nsegs].range.size = reads[i]->size;
+		segs[nsegs].range.data = NULL;
+		segs[nsegs].ret = -1;
+		nsegs++;
+	}
+
+	for (i = 0; i < nsegs; i++)
+		if ((segs[i].range.data = buf_alloc(segs[i].range.size)) == NULL)
+			goto out;
+
+	fetch_segments(b->module, b->url, segs, nsegs);
+
+	/* hand each read its slice */
+	for (i = 0, j = 0; i < n; i++) {
+		struct segment *s;
+		long long skip;
+
+		r = reads[i];
+		while (r->off >= segs[j].range.off +
+		                 (long long) segs[j].range.size)
+			j++;
+		s = &segs[j];
+
+		skip = r->off - s->range.off;
+		if (s->ret == (size_t) -1) {
+			r->ret = -1;
+		} else if ((long long) s->ret <= skip) {
+			r->ret = 0;
+		} else {
+			r->ret = s->ret - skip < r->size ? s->ret - skip : r->size;
+			memcpy(r->data, (char*) s->range.data + skip, r->ret);
+		}
+	}
+
+out:
+	for (i = 0; i < nsegs; i++)
+		buf_free(segs[i].range.data, segs[i].range.size);
+}
+
+/* *assume batches_lock is held */
+static void
+put_batch(struct batch *b)
+{
+	if (--b->refs)
+		return;
+
+	pthread_cond_destroy(&b->cond);
+	free(b);
+}
+
+/* *assume batches_lock is held */
+static int
+url_in_flight(char *url)
+{
+	struct read *r;
+
+	list_for_each_entry(r, &inflight, flight)
+		if (strcmp(r->url, url) == 0)
+			return 1;
+
+	return 0;
+}
+
+static int
+batch_fits(struct batch *b, char *url, size_t size, long long off)
+{
+	long long lo = off < b->lo ? off : b->lo;
+	long long end = off + (long long) size;
+	long long hi = end > b->hi ? end : b->hi;
+
+	return b->nreads < BATCH_MAX_READS && hi - lo <= BATCH_MAX_SPAN &&
+	       strcmp(b->url, url) == 0;
+}
+
+/**
+ * batch_get_data() Read like network_get_data(), possibly together with
+ * other nearby reads of the same URL.
+ */
+size_t
+batch_get_data(struct nmodule *module, char *url, size_t size, long long off,
+	       void *data)
+{
+	struct read r = {
+		.url = url, .off = off, .size = size, .data = data, .ret = -1,
+	};
+	pthread_condattr_t cattr;
+	struct timespec deadline;
+	struct batch *b;
+	size_t ret;
+
+	if (batch_window == 0 || size > BATCH_MAX_READ)
+		return network_get_data(module, url, size, off, data);
+
+	pthread_mutex_lock(&batches_lock);
+
+	/* nothing to batch with, nor likely to come */
+	if (!url_in_flight(url)) {
+		list_add(&r.flight, &inflight);
+		pthread_mutex_unlock(&batches_lock);
+
+		ret = network_get_data(module, url, size, off, data);
+
+		pthread_mutex_lock(&batches_lock);
+		list_del(&r.flight);
+		pthread_mutex_unlock(&batches_lock);
+		return ret;
+	}
+	list_add(&r.flight, &inflight);
+
+	list_for_each_entry(b, &batches, entry) {
+		if (!batch_fits(b, url, size, off))
+			continue;
+
+		/* join the batch and wait for its leader to run it */
+		list_add(&r.entry, &b->reads);
+		b->nreads++;
+		b->refs++;
+		if (off < b->lo)
+			b->lo = off;
+		if (off + (long long) size > b->hi)
+			b->hi = off + size;
+		if (b->nreads == BATCH_MAX_READS)
+			pthread_cond_broadcast(&b->cond);
+
+		while (!b->done)
+			pthread_cond_wait(&b->cond, &batches_lock);
+		goto out;
+	}
+
+	/* open a new batch and lead it */
+	if ((b = calloc(1, sizeof(struct batch))) == NULL) {
+		pthread_mutex_unlock(&batches_lock);
+		ret = network_get_data(module, url, size, off, data);
+		pthread_mutex_lock(&batches_lock);
+		list_del(&r.flight);
+		pthread_mutex_unlock(&batches_lock);
+		return ret;
+	}
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&b->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	INIT_LIST_HEAD(&b->reads);
+	list_add(&r.entry, &b->reads);
+	b->module = module;
+	b->url = url;
+	b->nreads = 1;
+	b->refs = 1;
+	b->lo = off;
+	b->hi = off + size;
+	list_add(&b->entry, &batches);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += batch_window * 1000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	while (b->nreads < BATCH_MAX_READS &&
+	       pthread_cond_timedwait(&b->cond, &batches_lock, &deadline)
+	       != ETIMEDOUT)
+		;
+
+	list_del(&b->entry);
+	pthread_mutex_unlock(&batches_lock);
+
+	run_batch(b);
+
+	pthread_mutex_lock(&batches_lock);
+	b->done = 1;
+	pthread_cond_broadcast(&b->cond);
+
+out:
+	ret = r.ret;
+	list_del(&r.flight);
+	put_batch(b);
+	pthread_mutex_unlock(&batches_lock);
+
+	return ret;
+}
+
+/* Window in microseconds during which small reads are collected */
+void
+batch_init(int window)
+{
+	INIT_LIST_HEAD(&batches);
+	INIT_LIST_HEAD(&inflight);
+
+	if (window >= 0)
+		batch_window = window;
+}
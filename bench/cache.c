@@ -0,0 +1,115 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Block cache hits per second, from 1 to 64 threads: each thread reads
+ * 64 bytes of random blocks out of 4096 cached ones, then all of them of a
+ * single hot block. The best of RUNS runs is shown, in millions of hits per
+ * second.
+ *
+ * usage: bench/cache [hits]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../buf.h"
+#include "../cache.h"
+#include "../mem.h"
+
+#define BLOCKS 4096
+#define KEYS 8
+#define MAX_THREADS 64
+#define RUNS 5
+
+static unsigned char keys[KEYS][CACHE_KEY_SIZE];
+static long hits_per_thread;
+static int hot;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+reader(void *arg)
+{
+	unsigned int seed = (unsigned long) arg * 7919 + 1;
+	char buf[64];
+	long i;
+	int r;
+
+	for (i = 0; i < hits_per_thread; i++) {
+		r = hot ? 0 : rand_r(&seed) % BLOCKS;
+		if (cache_get(keys[r % KEYS], r / KEYS, 0, sizeof(buf), buf)
+		    != sizeof(buf))
+			abort();
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	long hits = argc > 1 ? atol(argv[1]) : 4000000;
+	static char block[4096];
+	pthread_t threads[MAX_THREADS];
+	double start, t, best;
+	int n, i, run;
+
+	cache_init();
+	buf_init();
+	mem_init(0);
+
+	for (i = 0; i < KEYS; i++)
+		memset(keys[i], i + 1, CACHE_KEY_SIZE);
+	for (i = 0; i < BLOCKS; i++)
+		cache_put(keys[i % KEYS], i / KEYS, block, sizeof(block));
+
+	for (hot = 0; hot < 2; hot++) {
+		printf("%-14s", hot ? "hot block" : "random blocks");
+		for (n = 1; n <= MAX_THREADS; n *= 2) {
+			hits_per_thread = hits / n;
+			for (best = 0, run = 0; run < RUNS; run++) {
+				start = now();
+				for (i = 0; i < n; i++)
+					pthread_create(&threads[i], NULL,
+						       reader, (void*) (long) i);
+				for (i = 0; i < n; i++)
+					pthread_join(threads[i], NULL);
+				t = now() - start;
+				if (!best || t < best)
+					best = t;
+			}
+			printf(" %d:%.1f", n, hits_per_thread * n / best / 1e6);
+		}
+		printf(" Mhits/s\n");
+	}
+
+	return 0;
+}
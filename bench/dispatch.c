@@ -0,0 +1,92 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Cost of handing a read to a module: through the module resolved once
+ * (as links do), and resolving the URL on each read. Built against
+ * bench/stub.so as bench/dispatch, and with the stub linked in (what
+ * STATIC_MODULES does for cURL) as bench/dispatch_static.
+ *
+ * usage: bench/dispatch [reads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../modules/common.h"
+#include "../network.h"
+
+#define RUNS 5
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+	long reads = argc > 1 ? atol(argv[1]) : 100000000;
+	char url[] = "bench://host/path/to/some/file.bin";
+	struct nmodule *nm;
+	double start, t, best;
+	size_t sum = 0;
+	char data[1];
+	long i;
+	int run;
+
+	setenv("LIONFS_MODULE_PATH", "bench", 0);
+	start = now_ns();
+	network_open_all_modules();
+	printf("load           %8.0f us\n", (now_ns() - start) / 1000);
+
+	if ((nm = network_find_module(url)) == NULL) {
+		fprintf(stderr, "dispatch: no module for %s\n", url);
+		return 1;
+	}
+
+	/* best of RUNS runs, to leave out other load on the machine */
+	for (best = 0, run = 0; run < RUNS; run++) {
+		start = now_ns();
+		for (i = 0; i < reads; i++)
+			sum += network_get_data(nm, url, 1, i, data);
+		t = now_ns() - start;
+		if (!best || t < best)
+			best = t;
+	}
+	printf("resolved       %8.2f ns/read\n", best / reads);
+
+	for (best = 0, run = 0; run < RUNS; run++) {
+		start = now_ns();
+		for (i = 0; i < reads; i++)
+			sum += network_file_get_data(url, 1, i, data);
+		t = now_ns() - start;
+		if (!best || t < best)
+			best = t;
+	}
+	printf("resolve/read   %8.2f ns/read\n", best / reads);
+
+	return sum != (size_t) reads * RUNS * 2;
+}
@@ -0,0 +1,128 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+
+/*
+ * Concurrent range reads through the cURL module, the way the FUSE workers
+ * issue them: each of <threads> threads reads <reads> blocks of <block>
+ * bytes at random aligned offsets of <url>. Run by bench/http.sh against a
+ * local server speaking HTTP/2 and HTTP/1.1, with the module's tunables
+ * (LIONFS_HTTP_*) taken from the environment.
+ *
+ * usage: bench/http <url> <threads> [reads] [block]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../modules/common.h"
+#include "../network.h"
+
+static struct nmodule *nm;
+static char *url;
+static long long size;
+static long reads = 64;
+static size_t block = 128 * 1024;
+static volatile int failed;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void*
+reader(void *arg)
+{
+	unsigned int seed = (unsigned int) (size_t) arg;
+	long long off, blocks = size / block;
+	char *data;
+	long i;
+
+	if ((data = malloc(block)) == NULL) {
+		failed = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < reads && !failed; i++) {
+		off = (long long) (rand_r(&seed) % blocks) * block;
+		if (network_get_data(nm, url, block, off, data) != block)
+			failed = 1;
+	}
+
+	free(data);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	lionfile_info_t info;
+	pthread_t *threads;
+	double start, t;
+	long nthreads, i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <url> <threads> [reads] [block]\n",
+		        argv[0]);
+		return 2;
+	}
+	url = argv[1];
+	nthreads = atol(argv[2]);
+	if (argc > 3)
+		reads = atol(argv[3]);
+	if (argc > 4)
+		block = atol(argv[4]);
+
+	network_open_all_modules();
+	if ((nm = network_find_module(url)) == NULL ||
+	    network_file_get_info(url, &info) != 0 ||
+	    (size = info.size) < (long long) block) {
+		fprintf(stderr, "http: cannot read %s\n", url);
+		return 1;
+	}
+
+	if ((threads = calloc(nthreads, sizeof(*threads))) == NULL)
+		return 1;
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, reader, (void*) (i + 1));
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	t = now_ns() - start;
+
+	if (failed) {
+		fprintf(stderr, "http: a read of %s failed\n", url);
+		return 1;
+	}
+
+	printf("%4ld threads %8.1f MB/s %8.2f ms/read\n", nthreads,
+	       nthreads * reads * block / (t / 1e3),
+	       t / 1e6 / reads);
+
+	free(threads);
+	return 0;
+}
@@ -0,0 +1,70 @@
+#! /bin/bash
+#
+# lionfs, The Link Over Network File System
+# Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+# HTTP/2 multiplexing against an HTTP/1.1 connection pool: bench/http does
+# concurrent range reads through the cURL module against a local nghttpx,
+# which speaks both over TLS (chosen by ALPN) in front of the same
+# bench/range_server.py. Needs openssl, nghttpx and python3.
+#
+# usage: bench/http.sh [delay] [reads]
+#
+# <delay> (default 0.02 s) is added to each request by the server, as the
+# round trip to a remote mirror would be.
+
+delay="${1:-0.02}"
+reads="${2:-32}"
+port=18443
+backend=18080
+
+if [ ! -x bench/http -o ! -e modules/curl.so ]; then
+	echo "Run \`make bench/http' and \`make -C modules' first"
+	exit 1
+fi
+
+tmp="$(mktemp -d)"
+trap 'kill $(jobs -p) 2>/dev/null; wait; rm -rf "$tmp"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-addext subjectAltName=IP:127.0.0.1 \
+	-keyout "$tmp/key.pem" -out "$tmp/cert.pem" 2>/dev/null || exit 1
+head -c $((64 << 20)) /dev/urandom > "$tmp/file.bin"
+
+python3 bench/range_server.py $backend "$tmp/file.bin" "$delay" &
+nghttpx -f"127.0.0.1,$port" -b"127.0.0.1,$backend" --workers=1 \
+	--backend-connections-per-host=1024 --no-ocsp \
+	--errorlog-file=/dev/null "$tmp/key.pem" "$tmp/cert.pem" &
+sleep 1
+
+export LIONFS_HTTP_CA_BUNDLE="$tmp/cert.pem"
+url="https://127.0.0.1:$port/file.bin"
+
+run() {
+	echo "$1"
+	for threads in 1 8 32 64; do
+		env "${@:2}" bench/http "$url" $threads $reads || exit 1
+	done
+}
+
+run "HTTP/2, 100 streams (default)"
+run "HTTP/2, 8 streams" LIONFS_HTTP_STREAMS=8
+run "HTTP/1.1, 4 connections" LIONFS_HTTP_VERSION=1.1 \
+	LIONFS_HTTP_CONNECTIONS=4
+run "HTTP/1.1, 16 connections" LIONFS_HTTP_VERSION=1.1 \
+	LIONFS_HTTP_CONNECTIONS=16
+run "HTTP/1.1, unlimited connections" LIONFS_HTTP_VERSION=1.1
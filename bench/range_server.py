@@ -0,0 +1,76 @@
+#! /usr/bin/env python3
+#
+# lionfs, The Link Over Network File System
+# Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+# HTTP/1.1 server of one file with single byte ranges, for bench/http.sh
+# to put behind a TLS, HTTP/2 and HTTP/1.1 front end. Each request waits
+# <delay> seconds first, standing for the round trip to a remote mirror.
+#
+# usage: bench/range_server.py <port> <file> [delay]
+
+import http.server
+import os
+import sys
+import time
+
+port = int(sys.argv[1])
+path = sys.argv[2]
+delay = float(sys.argv[3]) if len(sys.argv) > 3 else 0
+data = open(path, 'rb').read()
+name = '/' + os.path.basename(path)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    # headers and body go out in two writes: don't hold the body back
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_HEAD(self):
+        self.do_GET(head=True)
+
+    def do_GET(self, head=False):
+        time.sleep(delay)
+        if self.path != name:
+            self.send_response(404)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        start, end, code = 0, len(data) - 1, 200
+        spec = self.headers.get('Range', '')
+        if spec.startswith('bytes='):
+            first, last = spec[6:].split('-')
+            start, code = int(first), 206
+            if last:
+                end = min(int(last), end)
+        self.send_response(code)
+        self.send_header('Content-Length', str(end - start + 1))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('Last-Modified', self.date_time_string(0))
+        if code == 206:
+            self.send_header('Content-Range',
+                             'bytes %d-%d/%d' % (start, end, len(data)))
+        self.end_headers()
+        if not head:
+            self.wfile.write(data[start:end + 1])
+
+
+http.server.ThreadingHTTPServer.request_queue_size = 256
+http.server.ThreadingHTTPServer(('127.0.0.1', port), Handler).serve_forever()
@@ -0,0 +1,66 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * A module serving the "bench" scheme whose reads return at once, so that
+ * only the cost of getting a read to a module is measured. Built as
+ * bench/stub.so, or linked into bench/dispatch_static.
+ */
+
+#include <stddef.h>
+
+#include "../modules/common.h"
+
+size_t
+get_data(void *data, char *url, long long off, size_t size)
+{
+	(void) data;
+	(void) url;
+	(void) off;
+
+	return size;
+}
+
+static int
+get_valid(char *url)
+{
+	(void) url;
+
+	return 0;
+}
+
+static int
+get_info(lionfile_info_t *info, char *url)
+{
+	(void) info;
+	(void) url;
+
+	return 0;
+}
+
+static const char *const schemes[] = { "bench", NULL };
+
+const struct lion_module lion_module = {
+	.name = "bench",
+	.schemes = schemes,
+	.get_data = get_data,
+	.get_valid = get_valid,
+	.get_info = get_info,
+};
@@ -0,0 +1,503 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Read buffer pool.
+ *
+ * Buffers come in power of two size classes and are carved out of slabs
+ * aligned to their size, so a buffer is aligned to its size (up to
+ * BUF_SLAB) and slabs of BUF_SLAB bytes can be backed by huge pages.
+ * Free buffers go to a free list of the thread freeing them, which spills
+ * to a free list shared by all threads; a thread with none left takes a
+ * handful from the shared list at once. Once the pool has grown to the
+ * reads in flight, getting and putting back buffers don't call the system
+ * allocator anymore -- `buf.allocs` in the stats counts the times it was.
+ *
+ * Free buffers are charged to MEM_POOL: those of the shared lists as they
+ * come and go, those a thread keeps in steps of THREAD_CHARGE bytes. A
+ * thread keeps at most THREAD_TOTAL bytes, and all threads together at
+ * most 1/THREAD_SHARE of the memory limit; the rest is shared. The pool's
+ * shrinker unmaps the slabs whose buffers are all on the shared lists
+ * (`buf.released` counts them), and has every thread give its buffers back
+ * to the shared lists the next time it gets or puts one.
+ *
+ * Buffers larger than the largest class are plain malloc()s.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "buf.h"
+#include "mem.h"
+
+#define BUF_MIN_SHIFT 6  /* 64 bytes */
+#define BUF_MAX_SHIFT 22 /* 4M */
+#define BUF_CLASSES (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+
+/* size and alignment of slabs backed by huge pages */
+#define BUF_SLAB (2 * 1024 * 1024)
+
+/* buffers of a slab, if that makes it smaller than BUF_SLAB */
+#define BUF_SLAB_BUFFERS 64
+
+/* bytes of a class a thread keeps for itself, at least THREAD_MIN buffers */
+#define THREAD_BYTES (1024 * 1024)
+#define THREAD_MIN 2
+
+/* bytes of all classes a thread keeps for itself */
+#define THREAD_TOTAL (4 * 1024 * 1024)
+
+/* all threads keep at most this fraction of the memory limit */
+#define THREAD_SHARE 8
+
+/* difference between what a thread keeps and has charged to MEM_POOL */
+#define THREAD_CHARGE (256 * 1024)
+
+struct free_buf {
+	struct free_buf *next;
+};
+
+struct class {
+	pthread_mutex_t lock;
+	struct free_buf *free;
+	unsigned long long refills;
+} __attribute__((aligned(64)));
+
+struct thread_list {
+	struct free_buf *free;
+	unsigned int count;
+};
+
+static struct class classes[BUF_CLASSES] = {
+	[0 ... BUF_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static __thread struct thread_list thread_lists[BUF_CLASSES];
+static __thread size_t thread_bytes, thread_charged;
+
+/* to give a thread's buffers back to the shared lists when it exits */
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static __thread int exit_registered;
+static unsigned int nthreads; /* registered, and not exited */
+
+/* threads give their buffers back when this changes, see buf_shrink() */
+static unsigned int flush_gen;
+static __thread unsigned int thread_gen;
+
+static unsigned long long allocs, slab_bytes, released;
+
+static inline int
+get_class(size_t size)
+{
+	int c = 0;
+
+	while (((size_t) 1 << (c + BUF_MIN_SHIFT)) < size)
+		c++;
+
+	return c;
+}
+
+static inline size_t
+class_size(int c)
+{
+	return (size_t) 1 << (c + BUF_MIN_SHIFT);
+}
+
+/* bytes of the slabs of a class */
+static inline size_t
+slab_len(int c)
+{
+	size_t size = class_size(c), len = size * BUF_SLAB_BUFFERS;
+
+	if (len > BUF_SLAB)
+		len = size > BUF_SLAB ? size : BUF_SLAB;
+
+	return len;
+}
+
+static inline unsigned int
+thread_max(int c)
+{
+	unsigned int n = THREAD_BYTES / class_size(c);
+
+	return n > THREAD_MIN ? n : THREAD_MIN;
+}
+
+/* bytes a thread may keep, its share of the limit if that's less */
+static inline size_t
+thread_total(void)
+{
+	size_t limit = mem_get_limit() / THREAD_SHARE;
+	unsigned int n = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+
+	if (limit && n && limit / n < THREAD_TOTAL)
+		return limit / n;
+
+	return THREAD_TOTAL;
+}
+
+/* bring the MEM_POOL charge for this thread's buffers up to date */
+static void
+thread_charge(int force)
+{
+	if (thread_bytes > thread_charged &&
+	    (force || thread_bytes - thread_charged >= THREAD_CHARGE)) {
+		mem_charge(MEM_POOL, thread_bytes - thread_charged);
+		thread_charged = thread_bytes;
+	} else if (thread_bytes < thread_charged &&
+		   (force || thread_charged - thread_bytes >= THREAD_CHARGE)) {
+		mem_uncharge(MEM_POOL, thread_charged - thread_bytes);
+		thread_charged = thread_bytes;
+	}
+}
+
+/* give all the buffers of this thread back to the shared lists */
+static void
+thread_flush(void)
+{
+	struct free_buf *b;
+	struct class *cl;
+	int c;
+
+	for (c = 0; c < BUF_CLASSES; c++) {
+		cl = &classes[c];
+
+		pthread_mutex_lock(&cl->lock);
+		while ((b = thread_lists[c].free) != NULL) {
+			thread_lists[c].free = b->next;
+			b->next = cl->free;
+			cl->free = b;
+		}
+		mem_charge(MEM_POOL, thread_lists[c].count * class_size(c));
+		thread_bytes -= thread_lists[c].count * class_size(c);
+		thread_lists[c].count = 0;
+		pthread_mutex_unlock(&cl->lock);
+	}
+	thread_charge(1);
+}
+
+static void
+thread_exit(void *arg)
+{
+	(void) arg;
+
+	thread_flush();
+	__atomic_sub_fetch(&nthreads, 1, __ATOMIC_RELAXED);
+}
+
+/* flush this thread's buffers if the shrinker asked since it last did */
+static inline void
+check_flush(void)
+{
+	unsigned int gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+
+	if (gen != thread_gen) {
+		thread_gen = gen;
+		thread_flush();
+	}
+}
+
+static void
+init_exit_key(void)
+{
+	pthread_key_create(&exit_key, thread_exit);
+}
+
+/* map `len` bytes aligned to `align` (a power of two) */
+static void*
+map_aligned(size_t len, size_t align)
+{
+	char *p, *start;
+	size_t head;
+
+	p = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	start = (char*) (((unsigned long) p + align - 1) & ~(align - 1));
+	head = start - p;
+	if (head)
+		munmap(p, head);
+	munmap(start + len, align - head);
+
+	return start;
+}
+
+/* *assume class lock is held -- add a new slab to the shared free list */
+static int
+grow(int c)
+{
+	size_t size = class_size(c), len = slab_len(c), off;
+	struct free_buf *b;
+	char *slab;
+
+	if ((slab = map_aligned(len, len)) == NULL)
+		return -1;
+#ifdef MADV_HUGEPAGE
+	if (len >= BUF_SLAB)
+		madvise(slab, len, MADV_HUGEPAGE);
+#endif
+
+	for (off = len; off; off -= size) {
+		b = (struct free_buf*) (slab + off - size);
+		b->next = classes[c].free;
+		classes[c].free = b;
+	}
+
+	mem_charge(MEM_POOL, len);
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&slab_bytes, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* move up to half of what a thread keeps from the shared list to it */
+static void
+refill(int c)
+{
+	struct thread_list *tl = &thread_lists[c];
+	struct class *cl = &classes[c];
+	struct free_buf *b;
+	size_t size = class_size(c), max = thread_total();
+	unsigned int n = thread_max(c) / 2, moved = 0;
+
+	/* at least the buffer asked for, past thread_total() if need be */
+	if (thread_bytes >= max)
+		n = 1;
+	else if (n > (max - thread_bytes) / size)
+		n = (max - thread_bytes) / size;
+	if (n == 0)
+		n = 1;
+
+	pthread_mutex_lock(&cl->lock);
+
+	cl->refills++;
+	if (!cl->free)
+		grow(c);
+
+	for (; n && (b = cl->free) != NULL; n--) {
+		cl->free = b->next;
+		b->next = tl->free;
+		tl->free = b;
+		tl->count++;
+		moved++;
+	}
+	mem_uncharge(MEM_POOL, moved * size);
+
+	pthread_mutex_unlock(&cl->lock);
+
+	thread_bytes += moved * size;
+}
+
+static int
+cmp_ptr(const void *a, const void *b)
+{
+	const char *pa = *(char* const*) a, *pb = *(char* const*) b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/* unmap the slabs of a class all free on its shared list, return bytes */
+static size_t
+release_slabs(int c)
+{
+	struct class *cl = &classes[c];
+	size_t size = class_size(c), len = slab_len(c), per = len / size;
+	size_t n = 0, i, j, freed = 0;
+	struct free_buf *b, **bufs, **tail;
+	char *slab;
+
+	pthread_mutex_lock(&cl->lock);
+
+	for (b = cl->free; b; b = b->next)
+		n++;
+	if (n < per || (bufs = malloc(n * sizeof(*bufs))) == NULL) {
+		pthread_mutex_unlock(&cl->lock);
+		return 0;
+	}
+	for (i = 0, b = cl->free; b; b = b->next)
+		bufs[i++] = b;
+	qsort(bufs, n, sizeof(*bufs), cmp_ptr);
+
+	/* slabs are aligned to their length, their buffers now adjacent */
+	tail = &cl->free;
+	for (i = 0; i < n; i = j) {
+		slab = (char*) ((unsigned long) bufs[i] & ~(len - 1));
+		for (j = i + 1; j < n && (char*) bufs[j] < slab + len; j++)
+			;
+		if (j - i == per) {
+			munmap(slab, len);
+			freed += len;
+			continue;
+		}
+		for (; i < j; i++) {
+			*tail = bufs[i];
+			tail = &bufs[i]->next;
+		}
+	}
+	*tail = NULL;
+
+	mem_uncharge(MEM_POOL, freed);
+	pthread_mutex_unlock(&cl->lock);
+	free(bufs);
+
+	if (freed) {
+		__atomic_add_fetch(&released, freed / len, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&slab_bytes, freed, __ATOMIC_RELAXED);
+	}
+
+	return freed;
+}
+
+/*
+ * mem.c shrinker -- give back free slabs, largest classes first. Buffers
+ * threads keep come back to the shared lists as the threads run, so their
+ * slabs go on a later call.
+ */
+static size_t
+buf_shrink(size_t want)
+{
+	size_t freed = 0;
+	int c;
+
+	__atomic_add_fetch(&flush_gen, 1, __ATOMIC_RELAXED);
+
+	for (c = BUF_CLASSES - 1; c >= 0 && freed < want; c--)
+		freed += release_slabs(c);
+
+	return freed;
+}
+
+/**
+ * buf_alloc() Get a buffer of at least `size` bytes, to be given back with
+ * buf_free() and the same size. Return NULL if there's no memory.
+ */
+void*
+buf_alloc(size_t size)
+{
+	struct thread_list *tl;
+	struct free_buf *b;
+	int c;
+
+	if (size > class_size(BUF_CLASSES - 1)) {
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+		return malloc(size);
+	}
+
+	if (!exit_registered) {
+		pthread_once(&exit_once, init_exit_key);
+		pthread_setspecific(exit_key, &exit_registered);
+		exit_registered = 1;
+		thread_gen = __atomic_load_n(&flush_gen, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&nthreads, 1, __ATOMIC_RELAXED);
+	}
+	check_flush();
+
+	c = get_class(size);
+	tl = &thread_lists[c];
+
+	if (!tl->free)
+		refill(c);
+	if ((b = tl->free) == NULL)
+		return NULL;
+
+	tl->free = b->next;
+	tl->count--;
+	thread_bytes -= class_size(c);
+	thread_charge(0);
+
+	return b;
+}
+
+void
+buf_free(void *buf, size_t size)
+{
+	struct thread_list *tl;
+	struct free_buf *b = buf;
+	struct class *cl;
+	int c;
+
+	if (!buf)
+		return;
+
+	if (size > class_size(BUF_CLASSES - 1)) {
+		free(buf);
+		return;
+	}
+
+	c = get_class(size);
+	tl = &thread_lists[c];
+
+	/* a thread which never allocated would keep them past its exit */
+	if (exit_registered)
+		check_flush();
+	if (exit_registered && tl->count < thread_max(c) &&
+	    thread_bytes + class_size(c) <= thread_total()) {
+		b->next = tl->free;
+		tl->free = b;
+		tl->count++;
+		thread_bytes += class_size(c);
+		thread_charge(0);
+		return;
+	}
+
+	cl = &classes[c];
+	pthread_mutex_lock(&cl->lock);
+	b->next = cl->free;
+	cl->free = b;
+	mem_charge(MEM_POOL, class_size(c));
+	pthread_mutex_unlock(&cl->lock);
+}
+
+/* Memory actually taken by a buffer of `size` bytes */
+size_t
+buf_size(size_t size)
+{
+	return size > class_size(BUF_CLASSES - 1) ? size
+						   : class_size(get_class(size));
+}
+
+int
+buf_print(char *buf, size_t len)
+{
+	unsigned long long refills = 0;
+	int c, n;
+
+	for (c = 0; c < BUF_CLASSES; c++)
+		refills += __atomic_load_n(&classes[c].refills,
+					   __ATOMIC_RELAXED);
+
+	n = snprintf(buf, len, "buf.allocs %llu\nbuf.refills %llu\n"
+		     "buf.slab_bytes %llu\nbuf.released %llu\n",
+		     __atomic_load_n(&allocs, __ATOMIC_RELAXED), refills,
+		     __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED),
+		     __atomic_load_n(&released, __ATOMIC_RELAXED));
+
+	return (size_t) n < len ? n : (int) len;
+}
+
+/* *must be called after cache_init(), so caches are shrunk first */
+void
+buf_init(void)
+{
+	mem_register_shrinker(buf_shrink);
+}
@@ -0,0 +1,628 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Block cache.
+ *
+ * Entries are keyed by (key, index): for link data the key identifies the
+ * remote file (see lionfile_t) and the index is the CACHE_BLOCK-sized block
+ * number. Entries live in a hash table and a CLOCK list, and their memory
+ * (pooled buffers, see buf.c) is charged to MEM_CACHE -- when the memory
+ * limit is reached, entries not hit since the hand last passed them are
+ * evicted.
+ *
+ * The table is split in CACHE_STRIPES stripes, each a range of buckets with
+ * its own lock and list in a cache line of its own, so reads of different
+ * blocks on different CPUs don't contend. A hit only takes the read side of
+ * its stripe's lock and sets the entry's reference bit, and hits and misses
+ * are counted in a slot of the thread's own, so hits of the same stripe
+ * don't serialize either. Eviction takes turns between stripes.
+ *
+ * Link blocks missing here are looked up in the cache shared with other
+ * mounts (see shared.c) before being fetched, and blocks fetched are
+ * published there.
+ *
+ * Entries of pinned keys are never evicted, they only go away when their key
+ * is unpinned and the hand finds them not hit.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf.h"
+#include "cache.h"
+#include "linked_list.h"
+#include "lionfs.h"
+#include "mem.h"
+#include "modules/common.h"
+#include "shared.h"
+
+#define CACHE_BUCKETS 65536
+#define CACHE_STRIPES 64
+#define PIN_BUCKETS 1024
+
+struct centry {
+	struct centry *hnext;
+	struct list_head lru;
+	unsigned char key[CACHE_KEY_SIZE];
+	unsigned long long index;
+	int ref; /* hit since the hand last passed */
+	size_t len;
+	char *data; /* a CACHE_BLOCK buffer, see buf.c */
+};
+
+/* a key pinned `count` times */
+struct pin {
+	struct pin *next;
+	unsigned char key[CACHE_KEY_SIZE];
+	int count;
+};
+
+struct stripe {
+	pthread_rwlock_t lock; /* read side for lookups */
+	struct list_head lru; /* hand at the tail, new entries at the head */
+} __attribute__((aligned(64)));
+
+/* hits and misses of the threads using this slot, see count() */
+struct counters {
+	unsigned long long hits, misses;
+	int users;
+} __attribute__((aligned(64)));
+
+static struct centry *buckets[CACHE_BUCKETS];
+static struct stripe stripes[CACHE_STRIPES];
+static unsigned int next_stripe; /* to shrink, see cache_shrink() */
+
+static struct counters counters[CACHE_STRIPES];
+static unsigned int next_counters;
+static __thread struct counters *thread_counters;
+static pthread_key_t counters_key; /* gives the slot back on thread exit */
+
+static struct pin *pins[PIN_BUCKETS];
+static pthread_mutex_t pins_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned int
+hash(const unsigned char *key, unsigned long long index)
+{
+	unsigned long long h;
+
+	/* keys are a cryptographic hash already, any part of them will do */
+	memcpy(&h, key, sizeof(h));
+	h = (h ^ index) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 48;
+}
+
+/* stripes own consecutive buckets, so they don't share cache lines */
+static inline struct stripe*
+get_stripe(const unsigned char *key, unsigned long long index)
+{
+	return &stripes[hash(key, index) / (CACHE_BUCKETS / CACHE_STRIPES)];
+}
+
+/* a slot no other thread uses, or a shared one past CACHE_STRIPES threads */
+static struct counters*
+get_counters(void)
+{
+	unsigned int start;
+	struct counters *c;
+	int i, unused;
+
+	start = __atomic_fetch_add(&next_counters, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < CACHE_STRIPES; i++) {
+		c = &counters[(start + i) % CACHE_STRIPES];
+		unused = 0;
+		if (__atomic_compare_exchange_n(&c->users, &unused, 1, 0,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			goto out;
+	}
+	c = &counters[start % CACHE_STRIPES];
+	__atomic_add_fetch(&c->users, 1, __ATOMIC_RELAXED);
+
+out:
+	thread_counters = c;
+	pthread_setspecific(counters_key, c);
+	return c;
+}
+
+static void
+put_counters(void *arg)
+{
+	struct counters *c = arg;
+
+	__atomic_sub_fetch(&c->users, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * count a hit or a miss in the slot of this thread -- without an atomic
+ * read-modify-write while the slot is its own (a count may be lost the
+ * moment another thread starts sharing it)
+ */
+static inline void
+count(int hit)
+{
+	struct counters *c = thread_counters;
+	unsigned long long *n;
+
+	if (!c)
+		c = get_counters();
+
+	n = hit ? &c->hits : &c->misses;
+	if (__atomic_load_n(&c->users, __ATOMIC_RELAXED) > 1)
+		__atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(n, __atomic_load_n(n, __ATOMIC_RELAXED) + 1,
+				 __ATOMIC_RELAXED);
+}
+
+/* *assume stripe lock is held */
+static struct centry**
+find(const unsigned char *key, unsigned long long index)
+{
+	struct centry **e;
+
+	for (e = &buckets[hash(key, index)]; *e; e = &(*e)->hnext)
+		if ((*e)->index == index &&
+		    memcmp((*e)->key, key, CACHE_KEY_SIZE) == 0)
+			break;
+
+	return e;
+}
+
+/* *assume pins lock is held */
+static struct pin**
+find_pin(const unsigned char *key)
+{
+	struct pin **p;
+
+	for (p = &pins[hash(key, 0) % PIN_BUCKETS]; *p; p = &(*p)->next)
+		if (memcmp((*p)->key, key, CACHE_KEY_SIZE) == 0)
+			break;
+
+	return p;
+}
+
+/* memory taken by an entry of `len` bytes */
+static inline size_t
+entry_size(size_t len)
+{
+	return buf_size(sizeof(struct centry)) + buf_size(len);
+}
+
+/* *assume stripe lock is held */
+static size_t
+evict(struct centry **e)
+{
+	struct centry *entry = *e;
+	size_t size = entry_size(entry->len);
+
+	*e = entry->hnext;
+	list_del(&entry->lru);
+	buf_free(entry->data, entry->len);
+	buf_free(entry, sizeof(struct centry));
+
+	return size;
+}
+
+/**
+ * cache_get() Copy `size` bytes at `off` of a cached entry to `buf`. Return
+ * the number of bytes copied, or -1 if the entry is not cached.
+ */
+size_t
+cache_get(const unsigned char *key, unsigned long long index, size_t off,
+	  size_t size, void *buf)
+{
+	struct stripe *st = get_stripe(key, index);
+	struct centry *e;
+
+	pthread_rwlock_rdlock(&st->lock);
+
+	if ((e = *find(key, index)) == NULL) {
+		pthread_rwlock_unlock(&st->lock);
+		count(0);
+		return -1;
+	}
+
+	/* only written when not set, hot entries stay in shared caches */
+	if (!__atomic_load_n(&e->ref, __ATOMIC_RELAXED))
+		__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+
+	if (off > e->len)
+		off = e->len;
+	if (size > e->len - off)
+		size = e->len - off;
+	memcpy(buf, e->data + off, size);
+
+	pthread_rwlock_unlock(&st->lock);
+	count(1);
+
+	return size;
+}
+
+/* Tell whether an entry is cached */
+int
+cache_has(const unsigned char *key, unsigned long long index)
+{
+	struct stripe *st = get_stripe(key, index);
+	int ret;
+
+	pthread_rwlock_rdlock(&st->lock);
+	ret = *find(key, index) != NULL;
+	pthread_rwlock_unlock(&st->lock);
+
+	return ret;
+}
+
+/* Cache a copy of `data` -- silently skipped if there's no memory for it */
+void
+cache_put(const unsigned char *key, unsigned long long index, const void *data,
+	  size_t len)
+{
+	struct stripe *st = get_stripe(key, index);
+	struct centry *entry, **e;
+	size_t size = entry_size(len);
+	size_t freed = 0;
+
+	/* charge before locking, the charge may call cache_shrink() */
+	if (mem_charge(MEM_CACHE, size))
+		return;
+
+	if ((entry = buf_alloc(sizeof(struct centry))) == NULL) {
+		mem_uncharge(MEM_CACHE, size);
+		return;
+	}
+	if ((entry->data = buf_alloc(len)) == NULL) {
+		buf_free(entry, sizeof(struct centry));
+		mem_uncharge(MEM_CACHE, size);
+		return;
+	}
+	memcpy(entry->key, key, CACHE_KEY_SIZE);
+	entry->index = index;
+	entry->ref = 0;
+	entry->len = len;
+	memcpy(entry->data, data, len);
+
+	pthread_rwlock_wrlock(&st->lock);
+
+	/* someone else may have fetched the same block meanwhile */
+	if (*(e = find(key, index)) != NULL)
+		freed = evict(e);
+
+	entry->hnext = NULL;
+	*e = entry;
+	list_add(&entry->lru, &st->lru);
+
+	pthread_rwlock_unlock(&st->lock);
+
+	if (freed)
+		mem_uncharge(MEM_CACHE, freed);
+}
+
+/* Keep the entries of `key` from being evicted, until unpinned */
+int
+cache_pin(const unsigned char *key)
+{
+	struct pin **p, *pin;
+
+	pthread_mutex_lock(&pins_lock);
+
+	if ((pin = *(p = find_pin(key))) == NULL) {
+		if ((pin = malloc(sizeof(struct pin))) == NULL) {
+			pthread_mutex_unlock(&pins_lock);
+			return -1;
+		}
+		pin->next = NULL;
+		memcpy(pin->key, key, CACHE_KEY_SIZE);
+		pin->count = 0;
+		*p = pin;
+	}
+	pin->count++;
+
+	pthread_mutex_unlock(&pins_lock);
+
+	return 0;
+}
+
+void
+cache_unpin(const unsigned char *key)
+{
+	struct pin **p, *pin;
+
+	pthread_mutex_lock(&pins_lock);
+
+	if ((pin = *(p = find_pin(key))) != NULL && --pin->count == 0) {
+		*p = pin->next;
+		free(pin);
+	}
+
+	pthread_mutex_unlock(&pins_lock);
+}
+
+/* Bytes cached of entries [first, last) of a key */
+long long
+cache_resident(const unsigned char *key, unsigned long long first,
+	       unsigned long long last)
+{
+	struct stripe *st;
+	struct centry *e;
+	long long bytes = 0;
+
+	for (; first < last; first++) {
+		st = get_stripe(key, first);
+		pthread_rwlock_rdlock(&st->lock);
+		if ((e = *find(key, first)) != NULL)
+			bytes += e->len;
+		pthread_rwlock_unlock(&st->lock);
+	}
+
+	return bytes;
+}
+
+/*
+ * *assume stripe write lock is held -- evict the first entry from the hand
+ * not hit since it last passed, clearing the reference bit of those passed
+ */
+static size_t
+evict_clock(struct stripe *st)
+{
+	struct list_head *pos, *prev, *moved = NULL;
+	struct centry *entry;
+	int pinned;
+
+	for (pos = st->lru.prev; pos != &st->lru && pos != moved; pos = prev) {
+		prev = pos->prev;
+		entry = list_entry(pos, struct centry, lru);
+
+		if (entry->ref) {
+			entry->ref = 0;
+		} else {
+			pthread_mutex_lock(&pins_lock);
+			pinned = *find_pin(entry->key) != NULL;
+			pthread_mutex_unlock(&pins_lock);
+
+			if (!pinned)
+				return evict(find(entry->key, entry->index));
+		}
+
+		/* out of the way of the next evictions */
+		list_del(pos);
+		list_add(pos, &st->lru);
+		if (!moved)
+			moved = pos;
+	}
+
+	return 0;
+}
+
+/*
+ * Evict entries not hit lately, a mem_shrinker_t -- an entry of each
+ * stripe at a time, starting where the last call stopped
+ */
+static size_t
+cache_shrink(size_t want)
+{
+	struct stripe *st;
+	size_t freed = 0, n;
+	unsigned int i, idle = 0;
+
+	/*
+	 * stop after two turns over all stripes free nothing, the first
+	 * may only have cleared reference bits
+	 */
+	while (freed < want && idle < 2 * CACHE_STRIPES) {
+		i = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED);
+		st = &stripes[i % CACHE_STRIPES];
+
+		pthread_rwlock_wrlock(&st->lock);
+		n = evict_clock(st);
+		pthread_rwlock_unlock(&st->lock);
+
+		freed += n;
+		idle = n ? 0 : idle + 1;
+	}
+
+	mem_uncharge(MEM_CACHE, freed);
+
+	return freed;
+}
+
+/*
+ * fetch blocks [first, last) of `file` with a single request, cache them and
+ * copy the part from `off` to `buf` -- return the bytes copied or -1
+ */
+static size_t
+fetch_blocks(lionfile_t *file, unsigned long long first,
+	     unsigned long long last, char *buf, size_t size, long long off)
+{
+	long long span_off = first * CACHE_BLOCK;
+	size_t span = (last - first) * CACHE_BLOCK;
+	size_t ret, len, skip;
+	unsigned long long i;
+	void *data;
+	char *tmp;
+
+	if (span_off + (long long) span > file->size)
+		span = file->size - span_off;
+
+	mem_charge(MEM_INFLIGHT, span);
+	if ((data = buf_alloc(span)) == NULL) {
+		mem_uncharge(MEM_INFLIGHT, span);
+		return -1;
+	}
+
+	/* `data` may come back another buffer, see mirror.c */
+	ret = mirror_get_data(file->mirrors, file->nmirrors, span, span_off,
+			      &data);
+	tmp = data;
+	if (ret == (size_t) -1)
+		goto out;
+
+	for (i = first; i < last && (i - first) * CACHE_BLOCK < ret; i++) {
+		len = ret - (i - first) * CACHE_BLOCK;
+		if (len > CACHE_BLOCK)
+			len = CACHE_BLOCK;
+		/* a short block is only the last one of the file, otherwise
+		 * the transfer was cut short and the block is incomplete */
+		if (len < CACHE_BLOCK &&
+		    (long long) (i * CACHE_BLOCK + len) != file->size)
+			break;
+		cache_put(file->key, i, tmp + (i - first) * CACHE_BLOCK, len);
+		shared_put(file->key, i, tmp + (i - first) * CACHE_BLOCK, len);
+	}
+
+	skip = off - span_off;
+	len = ret > skip ? ret - skip : 0;
+	ret = len < size ? len : size;
+	memcpy(buf, tmp + skip, ret);
+
+out:
+	buf_free(data, span);
+	mem_uncharge(MEM_INFLIGHT, span);
+	return ret;
+}
+
+/*
+ * get block `index` of `file` from the shared cache, cache it here and copy
+ * `size` bytes at `off` of it to `buf` -- return the bytes copied or -1
+ */
+static size_t
+get_shared(lionfile_t *file, unsigned long long index, size_t off,
+	   size_t size, char *buf)
+{
+	size_t len;
+	char *tmp;
+
+	if (!shared_has(file->key, index))
+		return -1;
+
+	mem_charge(MEM_INFLIGHT, CACHE_BLOCK);
+	if ((tmp = buf_alloc(CACHE_BLOCK)) == NULL) {
+		mem_uncharge(MEM_INFLIGHT, CACHE_BLOCK);
+		return -1;
+	}
+
+	if ((len = shared_get(file->key, index, tmp)) != (size_t) -1) {
+		cache_put(file->key, index, tmp, len);
+
+		if (off > len)
+			off = len;
+		if (size > len - off)
+			size = len - off;
+		memcpy(buf, tmp + off, size);
+		len = size;
+	}
+
+	buf_free(tmp, CACHE_BLOCK);
+	mem_uncharge(MEM_INFLIGHT, CACHE_BLOCK);
+	return len;
+}
+
+/**
+ * cache_read() Read link data through the cache. Blocks not cached are
+ * fetched, a run of consecutive missing blocks in a single request.
+ * `off + size` must not be past the end of the file. Return the number of
+ * bytes read or -1 on error.
+ */
+size_t
+cache_read(lionfile_t *file, char *buf, size_t size, long long off)
+{
+	unsigned long long i, j, last;
+	size_t done = 0, ret, len, boff;
+
+	last = (off + size + CACHE_BLOCK - 1) / CACHE_BLOCK;
+
+	for (i = off / CACHE_BLOCK; i < last && done < size; ) {
+		boff = (off + done) % CACHE_BLOCK;
+		len = size - done < CACHE_BLOCK - boff ? size - done
+						       : CACHE_BLOCK - boff;
+
+		ret = cache_get(file->key, i, boff, len, buf + done);
+		if (ret != (size_t) -1) {
+			done += ret;
+			if (ret < len)
+				break;
+			i++;
+			continue;
+		}
+
+		/* if another mount is fetching the block, wait for it */
+		shared_lock(file->key, i);
+
+		ret = get_shared(file, i, boff, len, buf + done);
+		if (ret != (size_t) -1) {
+			shared_unlock(file->key, i);
+			done += ret;
+			if (ret < len)
+				break;
+			i++;
+			continue;
+		}
+
+		for (j = i + 1; j < last && !cache_has(file->key, j) &&
+		     !shared_has(file->key, j); j++)
+			;
+
+		ret = fetch_blocks(file, i, j, buf + done, size - done,
+				   off + done);
+		shared_unlock(file->key, i);
+		if (ret == (size_t) -1)
+			return done ? done : (size_t) -1;
+
+		done += ret;
+		if (done < size && (off + done) < j * CACHE_BLOCK)
+			break; /* short read */
+		i = j;
+	}
+
+	return done;
+}
+
+int
+cache_print(char *buf, size_t len)
+{
+	unsigned long long hits = 0, misses = 0;
+	int i, n;
+
+	for (i = 0; i < CACHE_STRIPES; i++) {
+		hits += __atomic_load_n(&counters[i].hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&counters[i].misses,
+					  __ATOMIC_RELAXED);
+	}
+
+	n = snprintf(buf, len, "cache.hits %llu\ncache.misses %llu\n",
+		     hits, misses);
+
+	return (size_t) n < len ? n : (int) len;
+}
+
+void
+cache_init(void)
+{
+	int i;
+
+	for (i = 0; i < CACHE_STRIPES; i++) {
+		pthread_rwlock_init(&stripes[i].lock, NULL);
+		INIT_LIST_HEAD(&stripes[i].lru);
+	}
+	pthread_key_create(&counters_key, put_counters);
+	mem_register_shrinker(cache_shrink);
+}
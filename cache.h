@@ -0,0 +1,53 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* size of the blocks links are cached in */
+#define CACHE_BLOCK (128 * 1024)
+
+/* bytes of the keys cached data is identified by (SHA-256, see make_key()) */
+#define CACHE_KEY_SIZE 32
+
+size_t
+cache_get(const unsigned char*, unsigned long long, size_t, size_t, void*);
+
+int
+cache_has(const unsigned char*, unsigned long long);
+
+void
+cache_put(const unsigned char*, unsigned long long, const void*, size_t);
+
+int
+cache_pin(const unsigned char*);
+
+void
+cache_unpin(const unsigned char*);
+
+long long
+cache_resident(const unsigned char*, unsigned long long, unsigned long long);
+
+struct lionfile;
+
+size_t
+cache_read(struct lionfile*, char*, size_t, long long);
+
+int
+cache_print(char*, size_t);
+
+void
+cache_init(void);
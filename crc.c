@@ -0,0 +1,131 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Checksums of blocks.
+ *
+ * CRC32C (Castagnoli) uses the crc32 instruction of SSE 4.2 when the CPU
+ * has it, and a slicing-by-8 table otherwise. Both give the same result as
+ * the usual crc32c(), so checksums stored by one host can be checked by
+ * another. The CRC32 of zip and gzip (IEEE) is zlib's.
+ */
+
+#include <pthread.h>
+#include <zlib.h>
+
+#include "crc.h"
+
+#define CRC32C_POLY 0x82f63b78 /* reversed */
+
+static uint32_t table[8][256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static uint32_t (*update)(uint32_t, const unsigned char*, size_t);
+
+static uint32_t
+update_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len && ((uintptr_t) p & 7); len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	/* eight bytes at a time (little endian) */
+	for (; len >= 8; len -= 8, p += 8) {
+		v = *(const uint64_t*) p ^ crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+		      table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+		      table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+		      table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+	}
+
+	for (; len; len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+update_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+
+	for (; len && ((uintptr_t) p & 7); len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	for (; len >= 8; len -= 8, p += 8)
+		c = __builtin_ia32_crc32di(c, *(const uint64_t*) p);
+
+	for (; len; len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	return c;
+}
+#endif
+
+static void
+init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = table[0][table[j - 1][i] & 0xff] ^
+				      (table[j - 1][i] >> 8);
+
+	update = update_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		update = update_hw;
+#endif
+}
+
+/**
+ * crc32c() Update the CRC32C `crc` of some data with `len` bytes more of
+ * it. The CRC32C of no data is 0.
+ */
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&init_once, init);
+
+	return ~update(~crc, data, len);
+}
+
+/* As crc32c(), for the CRC32 of zip and gzip */
+uint32_t
+crc32_ieee(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uInt n;
+
+	for (; len; len -= n, p += n) {
+		n = len > 1U << 30 ? 1U << 30 : len;
+		crc = crc32(crc, p, n);
+	}
+
+	return crc;
+}
@@ -0,0 +1,229 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir.h"
+#include "lionfs.h"
+#include "mem.h"
+
+#define DIR_MIN_SIZE 8
+
+/*
+ * a free slot holds the index of the next free one, tagged in the lowest
+ * bit (which is never set in a pointer to a child) -- so the top bit of an
+ * index is lost, and the end of the list must fit without it
+ */
+#define NO_SLOT (SIZE_MAX >> 1)
+#define FREE_SLOT(next) ((struct lionfile*) (((next) << 1) | 1))
+#define IS_FREE_SLOT(p) ((uintptr_t) (p) & 1)
+#define NEXT_FREE_SLOT(p) ((uintptr_t) (p) >> 1)
+
+static size_t
+hash_name(const char *name, size_t len)
+{
+	size_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+	while (len--)
+		h = (h ^ (unsigned char) *name++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+/* index memory is charged to MEM_LINKS, as the children themselves */
+static void*
+dir_alloc(void *ptr, size_t old, size_t new)
+{
+	void *tmp;
+
+	if (mem_charge(MEM_LINKS, new))
+		return NULL;
+
+	if ((tmp = realloc(ptr, new)) == NULL) {
+		mem_uncharge(MEM_LINKS, new);
+		return NULL;
+	}
+	mem_uncharge(MEM_LINKS, old);
+
+	return tmp;
+}
+
+static void
+dir_release(void *ptr, size_t size)
+{
+	free(ptr);
+	mem_uncharge(MEM_LINKS, size);
+}
+
+static int
+grow_hash(struct liondir *dir)
+{
+	struct lionfile **hash, *child, *next;
+	size_t size = dir->hash_size * 2, i, h;
+
+	if ((hash = dir_alloc(NULL, 0, size * sizeof(*hash))) == NULL)
+		return -1;
+	memset(hash, 0, size * sizeof(*hash));
+
+	for (i = 0; i < dir->hash_size; i++) {
+		for (child = dir->hash[i]; child; child = next) {
+			next = child->hash_next;
+			h = hash_name(child->name, strlen(child->name)) % size;
+			child->hash_next = hash[h];
+			hash[h] = child;
+		}
+	}
+
+	dir_release(dir->hash, dir->hash_size * sizeof(*hash));
+	dir->hash = hash;
+	dir->hash_size = size;
+
+	return 0;
+}
+
+/* take a free slot, or a new one at the end */
+static int
+get_slot(struct liondir *dir, size_t *slot)
+{
+	struct lionfile **slots;
+	size_t size;
+
+	if (dir->free_slot != NO_SLOT) {
+		*slot = dir->free_slot;
+		dir->free_slot = NEXT_FREE_SLOT(dir->slots[*slot]);
+		return 0;
+	}
+
+	if (dir->nslots == dir->slots_size) {
+		size = dir->slots_size * 2;
+		slots = dir_alloc(dir->slots, dir->slots_size * sizeof(*slots),
+				  size * sizeof(*slots));
+		if (slots == NULL)
+			return -1;
+		dir->slots = slots;
+		dir->slots_size = size;
+	}
+
+	*slot = dir->nslots++;
+	return 0;
+}
+
+struct lionfile*
+dir_lookup(struct liondir *dir, const char *name, size_t len)
+{
+	struct lionfile *child;
+
+	child = dir->hash[hash_name(name, len) % dir->hash_size];
+	for (; child; child = child->hash_next)
+		if (strncmp(child->name, name, len) == 0 &&
+		    child->name[len] == '\0')
+			return child;
+
+	return NULL;
+}
+
+/* *the child's name must not be in the directory yet */
+int
+dir_add(struct liondir *dir, struct lionfile *child)
+{
+	size_t h;
+
+	if (dir->nchildren >= dir->hash_size && grow_hash(dir))
+		return -1;
+
+	if (get_slot(dir, &child->slot))
+		return -1;
+	dir->slots[child->slot] = child;
+
+	h = hash_name(child->name, strlen(child->name)) % dir->hash_size;
+	child->hash_next = dir->hash[h];
+	dir->hash[h] = child;
+
+	dir->nchildren++;
+	return 0;
+}
+
+void
+dir_del(struct liondir *dir, struct lionfile *child)
+{
+	struct lionfile **p;
+	size_t h;
+
+	h = hash_name(child->name, strlen(child->name)) % dir->hash_size;
+	for (p = &dir->hash[h]; *p != child; p = &(*p)->hash_next)
+		;
+	*p = child->hash_next;
+
+	dir->slots[child->slot] = FREE_SLOT(dir->free_slot);
+	dir->free_slot = child->slot;
+
+	dir->nchildren--;
+}
+
+/* Return the first child at `*slot` or after it, and update `*slot` */
+struct lionfile*
+dir_next(struct liondir *dir, size_t *slot)
+{
+	for (; *slot < dir->nslots; (*slot)++)
+		if (!IS_FREE_SLOT(dir->slots[*slot]))
+			return dir->slots[*slot];
+
+	return NULL;
+}
+
+struct liondir*
+dir_new(void)
+{
+	struct liondir *dir;
+
+	if ((dir = dir_alloc(NULL, 0, sizeof(struct liondir))) == NULL)
+		return NULL;
+	memset(dir, 0, sizeof(struct liondir));
+
+	dir->free_slot = NO_SLOT;
+	dir->hash = dir_alloc(NULL, 0, DIR_MIN_SIZE * sizeof(*dir->hash));
+	if (dir->hash == NULL)
+		goto error;
+	dir->hash_size = DIR_MIN_SIZE;
+	memset(dir->hash, 0, DIR_MIN_SIZE * sizeof(*dir->hash));
+
+	dir->slots = dir_alloc(NULL, 0, DIR_MIN_SIZE * sizeof(*dir->slots));
+	if (dir->slots == NULL)
+		goto error;
+	dir->slots_size = DIR_MIN_SIZE;
+
+	return dir;
+
+error:
+	dir_free(dir);
+	return NULL;
+}
+
+/* *the directory must be empty */
+void
+dir_free(struct liondir *dir)
+{
+	if (dir->hash)
+		dir_release(dir->hash, dir->hash_size * sizeof(*dir->hash));
+	if (dir->slots)
+		dir_release(dir->slots, dir->slots_size * sizeof(*dir->slots));
+	dir_release(dir, sizeof(struct liondir));
+}
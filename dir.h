@@ -0,0 +1,53 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+struct lionfile;
+
+/*
+ * children of a directory, indexed by name for lookups and by slot for
+ * readdir -- a child keeps its slot while it lives, so a slot is a stable
+ * readdir offset
+ */
+struct liondir {
+	struct lionfile **hash; /* chained by lionfile_t `hash_next` */
+	size_t hash_size;
+	struct lionfile **slots; /* free slots are chained, see dir.c */
+	size_t nslots;
+	size_t slots_size;
+	size_t free_slot;
+	size_t nchildren;
+};
+
+struct lionfile*
+dir_lookup(struct liondir*, const char*, size_t);
+
+int
+dir_add(struct liondir*, struct lionfile*);
+
+void
+dir_del(struct liondir*, struct lionfile*);
+
+struct lionfile*
+dir_next(struct liondir*, size_t*);
+
+struct liondir*
+dir_new(void);
+
+void
+dir_free(struct liondir*);
@@ -39,6 +39,7 @@ function print_help {
 	echo "    --fuse-version  Print fuse version."
 	echo "    --fuse-help  Print fuse help."
 	echo "    --debug|-d  Active debug mode."
+	echo "    -o <options>  Mount options (e.g. \"-o hedge=99\")."
 	echo
 	echo "License: GNU/GPL (See COPYING); Author: Ricardo Biehl Pasquali"
 	exit 0
@@ -61,6 +62,10 @@ while [ 0 ]; do
 	"-d"|"--debug")
 		opt_arg="$opt_arg -d"
 	;;
+	"-o")
+		opt_arg="$opt_arg -o $2"
+		shift
+	;;
 	*)
 		break
 	;;
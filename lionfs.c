@@ -19,40 +19,391 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <openssl/evp.h>
 
+#include "archive.h"
+#include "batch.h"
+#include "buf.h"
+#include "cache.h"
+#include "dir.h"
 #include "lionfs.h"
+#include "mem.h"
 #include "modules/common.h"
 #include "network.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "seekable.h"
+#include "shared.h"
+#include "tasks.h"
 
 
-struct list_head  files;
+lionfile_t        root;
 pthread_rwlock_t  files_lock;
 
+/* mount options (-o name=value) */
+struct lion_options {
+	int hedge; /* latency percentile after which reads are hedged */
+	int batch; /* microseconds to wait for nearby reads to batch */
+	char *mem_limit; /* bytes, with an optional K, M or G suffix */
+	int archives; /* show zip and tar links as directories of members */
+	int decompress; /* serve seekable compressed links decompressed */
+	char *shared_cache; /* directory of the cache shared between mounts */
+	char *shared_cache_size; /* as mem_limit, if it's created by us */
+	int min_threads; /* workers serving requests, see pool.c */
+	int max_threads;
+	int pin_cpus; /* pin workers to CPUs */
+};
+
+static struct lion_options options = {
+	.hedge = 95,
+	.batch = 200,
+	.min_threads = 4,
+	.max_threads = 64,
+};
+
+/* memory limit used if none is given, 0 is no limit */
+#define DEFAULT_MEM_LIMIT (256ULL << 20)
+
+/* size of a new shared cache if none is given */
+#define DEFAULT_SHARED_SIZE (1ULL << 30)
+
+/* read-only file with usage statistics */
+#define STATS_PATH "/.stats"
+#define STATS_SIZE 4096
+
+/* extended attributes of links */
+#define XATTR_PREFETCH "user.lionfs.prefetch" /* set a range to warm up */
+#define XATTR_PIN      "user.lionfs.pin"      /* 1 keeps data in the cache */
+#define XATTR_CACHED   "user.lionfs.cached"   /* percentage in the cache */
+
+#define LION_OPT(t, p, v) { t, offsetof(struct lion_options, p), v }
+
+static const struct fuse_opt lion_opts[] = {
+	LION_OPT("hedge=%d", hedge, 0),
+	LION_OPT("batch=%d", batch, 0),
+	LION_OPT("mem_limit=%s", mem_limit, 0),
+	LION_OPT("archives", archives, 1),
+	LION_OPT("decompress", decompress, 1),
+	LION_OPT("shared_cache=%s", shared_cache, 0),
+	LION_OPT("shared_cache_size=%s", shared_cache_size, 0),
+	LION_OPT("min_threads=%d", min_threads, 0),
+	LION_OPT("max_threads=%d", max_threads, 0),
+	LION_OPT("pin_cpus", pin_cpus, 1),
+	FUSE_OPT_END
+};
+
 
 /*
- * *assume list r/w lock is held
- * during this function file list can't be modified (files won't be added or
- * removed) and path is also safe (will not be modified -- see lion_rename() )
+ * *assume tree r/w lock is held
+ * during this function the tree can't be modified (files won't be added or
+ * removed) and names are also safe (will not be modified -- see
+ * lion_rename() )
+ * the walk stops at a link: `rest` points to what is left of the path, a
+ * member if the link is an archive (see archive.h)
  */
 static lionfile_t*
+get_file_in_path(const char *path, const char **rest)
+{
+	lionfile_t *file = &root;
+	size_t len;
+
+	/* look each component up in its parent's index */
+	for (path++; *path && file->dir; path += len + (path[len] == '/')) {
+		len = strcspn(path, "/");
+		if ((file = dir_lookup(file->dir, path, len)) == NULL)
+			return NULL;
+	}
+
+	*rest = path;
+	return file;
+}
+
+/* *assume tree r/w lock is held, see get_file_in_path() */
+static lionfile_t*
 get_file_by_path(const char *path)
 {
 	lionfile_t *file;
+	const char *rest;
 
-	list_for_each_entry(file, &files, list_entry)
-		if (strcmp(path, file->path) == 0)
-			return file;
+	file = get_file_in_path(path, &rest);
 
-	return NULL;
+	return file && !*rest ? file : NULL;
+}
+
+/*
+ * *assume tree r/w lock is held
+ * return the directory where `path` would be and point `name` to its last
+ * component
+ */
+static lionfile_t*
+get_parent(const char *path, const char **name)
+{
+	lionfile_t *parent;
+	char *dirname;
+
+	if ((*name = strrchr(path, '/')) == NULL || !*++*name)
+		return NULL;
+
+	if ((dirname = strndup(path, *name - path)) == NULL)
+		return NULL;
+	parent = get_file_by_path(dirname);
+	free(dirname);
+
+	return parent && parent->dir ? parent : NULL;
+}
+
+/* names in our root directory used by lionfs itself */
+static int
+is_reserved(lionfile_t *parent, const char *name)
+{
+	return parent == &root &&
+	       (strcmp(name, ".ff") == 0 || strcmp(name, STATS_PATH + 1) == 0);
+}
+
+/* *the file must be out of the tree */
+static void
+free_file(lionfile_t *file)
+{
+	while (file->nmirrors--)
+		mirror_free(&file->mirrors[file->nmirrors]);
+	free(file->mirrors);
+	if (file->archive)
+		archive_free(file->archive);
+	if (file->seekable)
+		seekable_free(file->seekable);
+	if (file->dir)
+		dir_free(file->dir);
+	free(file->name);
+	pthread_rwlock_destroy(&file->lock);
+	free(file);
+}
+
+static unsigned long long
+parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size;
+
+	size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+/*
+ * identify a file's data by its (first) URL and validators, so the cache of
+ * links to the same data is shared and a changed file isn't served stale.
+ * The key is a SHA-256 of all of them: blocks are looked up by it alone, so
+ * two files must never end up with the same one.
+ */
+static void
+make_key(const char *url, lionfile_info_t *info, unsigned char *key)
+{
+	size_t ulen = strlen(url), elen = strlen(info->etag);
+	size_t len = 2 * sizeof(size_t) + ulen + elen + 2 * sizeof(long long);
+	unsigned char *msg, *p;
+	long long v;
+
+	/* lengths first, so no two (url, etag) pairs run together the same */
+	if ((p = msg = malloc(len)) == NULL) {
+		memset(key, 0, CACHE_KEY_SIZE);
+		return;
+	}
+	memcpy(p, &ulen, sizeof(ulen)); p += sizeof(ulen);
+	memcpy(p, url, ulen); p += ulen;
+	memcpy(p, &elen, sizeof(elen)); p += sizeof(elen);
+	memcpy(p, info->etag, elen); p += elen;
+	v = info->size;
+	memcpy(p, &v, sizeof(v)); p += sizeof(v);
+	v = info->mtime;
+	memcpy(p, &v, sizeof(v));
+
+	EVP_Digest(msg, len, key, NULL, EVP_sha256(), NULL);
+	free(msg);
+}
+
+/* size of the data a link is read as */
+static long long
+data_size(lionfile_t *file)
+{
+	return file->seekable ? seekable_size(file->seekable) : file->size;
+}
+
+/* key the data a link is read as is cached under, CACHE_KEY_SIZE bytes */
+static void
+data_key(lionfile_t *file, unsigned char *key)
+{
+	if (file->seekable)
+		seekable_key(file, key);
+	else
+		memcpy(key, file->key, CACHE_KEY_SIZE);
+}
+
+/* memory held by a link with this name and mirrors, see MEM_LINKS */
+static size_t
+link_size(const char *name, struct mirror *mirrors, int nmirrors)
+{
+	size_t size = sizeof(lionfile_t) + strlen(name) + 1;
+	int i;
+
+	for (i = 0; i < nmirrors; i++)
+		size += sizeof(struct mirror) + strlen(mirrors[i].url) + 1;
+
+	return size;
+}
+
+static int
+get_stats(char *buf, size_t len)
+{
+	int n;
+
+	n = mem_print(buf, len);
+	n += cache_print(buf + n, len - n);
+	n += prefetch_print(buf + n, len - n);
+	n += shared_print(buf + n, len - n);
+	n += pool_print(buf + n, len - n);
+	n += task_print(buf + n, len - n);
+	n += buf_print(buf + n, len - n);
+	n += network_print(buf + n, len - n);
+
+	return n;
+}
+
+/*
+ * return the link at `path`, or the one whose fakefile is at `path`, with its
+ * lock held (for writing if `write`) -- NULL if there's no such link
+ */
+static lionfile_t*
+get_link(const char *path, int write)
+{
+	lionfile_t *file;
+
+	if (strncmp(path, "/.ff/", 5) == 0)
+		path += 4;
+
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+	if ((file = get_file_by_path(path)) == NULL || file->dir) {
+		pthread_rwlock_unlock(&files_lock);
+		return NULL;
+	}
+
+	if (write)
+		pthread_rwlock_wrlock(&file->lock); /* file write lock */
+	else
+		pthread_rwlock_rdlock(&file->lock); /* file read lock */
+	pthread_rwlock_unlock(&files_lock);
+
+	return file;
+}
+
+/* drop a reference to a file, the last one frees it */
+static void
+put_file(lionfile_t *file)
+{
+	if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free_file(file);
+}
+
+/* parse a "<start>-<end>" range of a file of `size` bytes, end exclusive */
+static int
+parse_range(const char *str, long long size, long long *start,
+	    long long *end)
+{
+	const char *dash;
+
+	if ((dash = strchr(str, '-')) == NULL)
+		return -1;
+
+	*start = dash > str ? (long long) parse_size(str) : 0;
+	*end = dash[1] ? (long long) parse_size(dash + 1) : size;
+	if (*end > size)
+		*end = size;
+
+	return 0;
+}
+
+/*
+ * split `target` into whitespace-separated URLs and check that all of them
+ * refer to the same file -- return the number of mirrors or -errno
+ */
+static int
+get_mirrors(const char *target, struct mirror **mirrors,
+	    lionfile_info_t *file_info)
+{
+	lionfile_info_t info;
+	struct mirror *m = NULL, *tmp;
+	char *copy, *url, *saveptr;
+	int n = 0, ret = -EINVAL;
+
+	if ((copy = strdup(target)) == NULL)
+		return -ENOMEM;
+
+	for (url = strtok_r(copy, " \t\n", &saveptr); url;
+	     url = strtok_r(NULL, " \t\n", &saveptr)) {
+		/* check if URL exists and get its info */
+		if (network_file_get_valid(url) ||
+		    network_file_get_info(url, &info)) {
+			ret = -EHOSTUNREACH;
+			goto error;
+		}
+
+		if (n == 0) {
+			*file_info = info;
+		} else if (info.size != file_info->size ||
+			   (*info.etag && *file_info->etag &&
+			    strcmp(info.etag, file_info->etag) != 0)) {
+			ret = -EINVAL;
+			goto error;
+		}
+
+		if ((tmp = realloc(m, (n + 1) * sizeof(struct mirror))) == NULL) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		m = tmp;
+
+		if (mirror_set_url(&m[n], url)) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		n++;
+	}
+
+	if (n == 0)
+		goto error;
+
+	free(copy);
+	*mirrors = m;
+	return n;
+
+error:
+	while (n--)
+		mirror_free(&m[n]);
+	free(m);
+	free(copy);
+	return ret;
 }
 
 
@@ -60,28 +411,32 @@ get_file_by_path(const char *path)
 // fuse operations:
 //   lion_getattr()   get attributes (information) from a file
 //   lion_readlink()  get target of a symbolic link (or get the fakefile ...)
+//   lion_mkdir()     creates a directory
 //   lion_unlink()    removes a file -- only symlinks in lionfs :-)
+//   lion_rmdir()     removes an empty directory
 //   lion_symlink()   creates a symlink
-//   lion_rename()    renames a file -- only symlinks as lion_unlink()
-//   lion_read()      reads content of a file (reads content of fakefiles)
-//   lion_readdir()   get files in a directory (get symlinks in lionfs array)
+//   lion_rename()    renames (or moves) a symlink or a directory
+//   lion_read()      reads content of a file (reads content of fakefiles
+//                    and of archive members)
+//   lion_readdir()   get files in a directory (a page of them at a time)
+//   lion_open()      opens a file (keeps a fakefile's link at hand for reads)
+//   lion_release()   closes a file
+//   lion_setxattr()  gives hints about a link: prefetch or pin its data
+//   lion_getxattr()  gets the state of those hints and of the link's cache
+//   lion_listxattr() lists the attributes above
+//   lion_removexattr() unpins a link
+//   lion_init()      starts what must run after FUSE has daemonized
 // ================
 
 static int
 lion_getattr(const char *path, struct stat *buf)
 {
 	lionfile_t *file;
-	int is_fakefile = 0;
+	const char *member;
+	int is_fakefile = 0, ret;
 
 	memset(buf, 0, sizeof(struct stat));
 
-	/* check if path is our root directory */
-	if (strcmp(path, "/") == 0) {
-		buf->st_mode = S_IFDIR | 0775;
-		buf->st_nlink = 2;
-		return 0;
-	}
-
 	/* check if path is the fakefiles directory */
 	if (strcmp(path, "/.ff") == 0) {
 		/* fakefiles directory needs to be read-only */
@@ -90,15 +445,22 @@ lion_getattr(const char *path, struct stat *buf)
 		return 0;
 	}
 
+	if (strcmp(path, STATS_PATH) == 0) {
+		buf->st_mode = S_IFREG | 0444;
+		buf->st_nlink = 1;
+		return 0;
+	}
+
 	/* check if path could be a fakefile */
 	if (strncmp(path, "/.ff/", 5) == 0) {
 		path += 4;
 		is_fakefile = 1;
 	}
 
-	/* check if file exists */
-	pthread_rwlock_rdlock(&files_lock); /* list read lock */
-	if ((file = get_file_by_path(path)) == NULL) {
+	/* check if file exists -- members of archives only under /.ff */
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+	if ((file = get_file_in_path(path, &member)) == NULL ||
+	    (*member && (!is_fakefile || !file->archive))) {
 		pthread_rwlock_unlock(&files_lock);
 		return -ENOENT;
 	}
@@ -106,11 +468,31 @@ lion_getattr(const char *path, struct stat *buf)
 	pthread_rwlock_rdlock(&file->lock); /* file read lock */
 	pthread_rwlock_unlock(&files_lock);
 
+	if (is_fakefile && file->archive) {
+		/* the fakefile of an archive is a directory of its members */
+		ret = archive_getattr(file->archive, member, buf);
+		if (ret == 0 && buf->st_mtime == 0)
+			buf->st_mtime = file->mtime;
+
+		pthread_rwlock_unlock(&file->lock);
+		return ret;
+	}
+
+	if (file->dir) {
+		/* fakefiles directories are read-only, as /.ff */
+		buf->st_mode = S_IFDIR | (is_fakefile ? 0444 : file->mode);
+		buf->st_mtime = file->mtime;
+		buf->st_nlink = 2;
+
+		pthread_rwlock_unlock(&file->lock);
+		return 0;
+	}
+
 	if (is_fakefile) {
 		buf->st_mode = S_IFREG | 0444;
 		buf->st_mtime = file->mtime;
 		buf->st_nlink = 0;
-		buf->st_size = file->size;
+		buf->st_size = data_size(file);
 
 		pthread_rwlock_unlock(&file->lock);
 		return 0;
@@ -120,7 +502,7 @@ lion_getattr(const char *path, struct stat *buf)
 	buf->st_mode = file->mode | S_IFLNK; /* S_IFLNK = symlink bitmask */
 	buf->st_mtime = file->mtime; /* modification time */
 	buf->st_nlink = 1; /*number of hard links (here it's not so important)*/
-	buf->st_size = file->size;
+	buf->st_size = data_size(file);
 
 	pthread_rwlock_unlock(&file->lock);
 
@@ -131,20 +513,74 @@ static int
 lion_readlink(const char *path, char *buf, size_t len)
 {
 	lionfile_t *file;
+	const char *p;
+	size_t n = 0;
 
 	/* if symlink does not exist we can't proceed */
-	pthread_rwlock_rdlock(&files_lock); /* list read lock */
-	if ((file = get_file_by_path(path)) == NULL) {
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+	if ((file = get_file_by_path(path)) == NULL || file->dir) {
 		pthread_rwlock_unlock(&files_lock);
-		return -ENOENT;
+		return file ? -EINVAL : -ENOENT;
 	}
-
-	pthread_rwlock_rdlock(&file->lock); /* file read lock */
 	pthread_rwlock_unlock(&files_lock);
 
-	snprintf(buf, len, ".ff/%s", file->path + 1);
+	/*
+	 * the target is relative to the symlink's directory: go up to our
+	 * root and then down the same path under /.ff
+	 */
+	for (p = strchr(path + 1, '/'); p && n < len; p = strchr(p + 1, '/'))
+		n += snprintf(buf + n, len - n, "../");
+	if (n < len)
+		snprintf(buf + n, len - n, ".ff%s", path);
 
-	pthread_rwlock_unlock(&file->lock);
+	return 0;
+}
+
+static int
+lion_mkdir(const char *path, mode_t mode)
+{
+	lionfile_t *parent, *file;
+	const char *name;
+	size_t size;
+
+	if ((file = calloc(1, sizeof(lionfile_t))) == NULL)
+		return -ENOMEM;
+	pthread_rwlock_init(&file->lock, NULL);
+	file->refs = 1;
+	file->mode = mode & 0777;
+	file->mtime = time(NULL);
+
+	pthread_rwlock_wrlock(&files_lock); /* tree write lock */
+
+	if ((parent = get_parent(path, &name)) == NULL) {
+		pthread_rwlock_unlock(&files_lock);
+		free_file(file);
+		return -ENOENT;
+	}
+	if (is_reserved(parent, name) ||
+	    dir_lookup(parent->dir, name, strlen(name)) != NULL) {
+		pthread_rwlock_unlock(&files_lock);
+		free_file(file);
+		return -EEXIST;
+	}
+
+	size = sizeof(lionfile_t) + strlen(name) + 1;
+	if (mem_charge(MEM_LINKS, size)) {
+		pthread_rwlock_unlock(&files_lock);
+		free_file(file);
+		return -ENOMEM;
+	}
+	if ((file->name = strdup(name)) == NULL ||
+	    (file->dir = dir_new()) == NULL ||
+	    dir_add(parent->dir, file)) {
+		pthread_rwlock_unlock(&files_lock);
+		mem_uncharge(MEM_LINKS, size);
+		free_file(file);
+		return -ENOMEM;
+	}
+	file->parent = parent;
+
+	pthread_rwlock_unlock(&files_lock);
 
 	return 0;
 }
@@ -153,107 +589,228 @@ static int
 lion_unlink(const char *path)
 {
 	lionfile_t *file;
+	unsigned char key[CACHE_KEY_SIZE];
 
 	/* if symlink does not exist we can't proceed */
-	pthread_rwlock_wrlock(&files_lock); /* list write lock */
-	if ((file = get_file_by_path(path)) == NULL) {
+	pthread_rwlock_wrlock(&files_lock); /* tree write lock */
+	if ((file = get_file_by_path(path)) == NULL || file == &root) {
 		pthread_rwlock_unlock(&files_lock);
 		return -ENOENT;
 	}
+	if (file->dir) {
+		pthread_rwlock_unlock(&files_lock);
+		return -EISDIR;
+	}
 
-	list_del(&file->list_entry);
+	dir_del(file->parent->dir, file);
 
 	pthread_rwlock_unlock(&files_lock);
 	pthread_rwlock_wrlock(&file->lock); /* file write lock */
 
-	free(file->path);
-	free(file->url);
+	mem_uncharge(MEM_LINKS,
+		     link_size(file->name, file->mirrors, file->nmirrors));
+	if (file->pinned) {
+		data_key(file, key);
+		cache_unpin(key);
+	}
 
 	pthread_rwlock_unlock(&file->lock);
 
-	pthread_rwlock_destroy(&file->lock);
-	free(file);
+	prefetch_cancel(file);
+	put_file(file);
 
 	return 0;
 }
 
 static int
-lion_symlink(const char *url, const char *path)
+lion_rmdir(const char *path)
 {
 	lionfile_t *file;
-	lionfile_info_t file_info;
-
-	/* check if URL exists and get its info */
-	if (network_file_get_valid((char*) url))
-		return -EHOSTUNREACH;
-	if (network_file_get_info((char*) url, &file_info))
-		return -EHOSTUNREACH;
 
-	file = malloc(sizeof(lionfile_t));
-	pthread_rwlock_init(&file->lock, NULL);
-
-	/* if symlink EXISTS we can't proceed */
-	pthread_rwlock_wrlock(&files_lock); /* list write lock */
-	if (get_file_by_path(path) != NULL) {
+	pthread_rwlock_wrlock(&files_lock); /* tree write lock */
+	if ((file = get_file_by_path(path)) == NULL || file == &root) {
 		pthread_rwlock_unlock(&files_lock);
-		pthread_rwlock_destroy(&file->lock);
-		free(file);
-		return -EEXIST;
+		return file ? -EBUSY : -ENOENT;
+	}
+	if (!file->dir) {
+		pthread_rwlock_unlock(&files_lock);
+		return -ENOTDIR;
+	}
+	if (file->dir->nchildren) {
+		pthread_rwlock_unlock(&files_lock);
+		return -ENOTEMPTY;
 	}
 
-	list_add(&file->list_entry, &files);
+	dir_del(file->parent->dir, file);
 
-	pthread_rwlock_wrlock(&file->lock); /* file write lock */
 	pthread_rwlock_unlock(&files_lock);
+	pthread_rwlock_wrlock(&file->lock); /* file write lock */
+
+	mem_uncharge(MEM_LINKS, sizeof(lionfile_t) + strlen(file->name) + 1);
 
-	file->path = malloc(strlen(path) + 1);
-	file->url = malloc(strlen(url) + 1);
+	pthread_rwlock_unlock(&file->lock);
 
-	strcpy(file->path, path);
-	strcpy(file->url, url);
+	put_file(file);
+
+	return 0;
+}
+
+/*
+ * the target is one URL or several equivalent ones (mirrors) separated by
+ * whitespace
+ */
+static int
+lion_symlink(const char *target, const char *path)
+{
+	lionfile_t *parent, *file;
+	lionfile_info_t file_info;
+	struct mirror *mirrors;
+	const char *name;
+	int nmirrors, ret;
+	size_t size;
+
+	if ((nmirrors = get_mirrors(target, &mirrors, &file_info)) < 0)
+		return nmirrors;
+
+	if ((file = calloc(1, sizeof(lionfile_t))) == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	pthread_rwlock_init(&file->lock, NULL);
+	file->refs = 1;
+
+	file->mirrors = mirrors;
+	file->nmirrors = nmirrors;
 
 	/* symlinks are read-only :-) -- fakefiles copy this */
 	file->mode = 0444;
 
 	file->size = file_info.size;
 	file->mtime = file_info.mtime;
+	make_key(mirrors[0].url, &file_info, file->key);
 
-	pthread_rwlock_unlock(&file->lock);
+	/* data in a format not known (or not enabled) is served as is */
+	if (options.decompress)
+		file->seekable = seekable_open(file);
+	if (options.archives && !file->seekable)
+		file->archive = archive_open(file);
+
+	pthread_rwlock_wrlock(&files_lock); /* tree write lock */
+
+	if ((parent = get_parent(path, &name)) == NULL) {
+		ret = -ENOENT;
+		goto error_unlock;
+	}
+
+	/* if symlink EXISTS we can't proceed */
+	if (is_reserved(parent, name) ||
+	    dir_lookup(parent->dir, name, strlen(name)) != NULL) {
+		ret = -EEXIST;
+		goto error_unlock;
+	}
+
+	size = link_size(name, mirrors, nmirrors);
+	if (mem_charge(MEM_LINKS, size)) {
+		ret = -ENOMEM;
+		goto error_unlock;
+	}
+	if ((file->name = strdup(name)) == NULL ||
+	    dir_add(parent->dir, file)) {
+		mem_uncharge(MEM_LINKS, size);
+		ret = -ENOMEM;
+		goto error_unlock;
+	}
+	file->parent = parent;
+
+	pthread_rwlock_unlock(&files_lock);
 
 	return 0;
+
+error_unlock:
+	pthread_rwlock_unlock(&files_lock);
+	free_file(file);
+	return ret;
+
+error:
+	while (nmirrors--)
+		mirror_free(&mirrors[nmirrors]);
+	free(mirrors);
+	return ret;
 }
 
 static int
 lion_rename(const char *oldpath, const char *newpath)
 {
-	lionfile_t *file;
+	lionfile_t *file, *oldparent, *parent, *p;
+	const char *name;
+	char *newname, *oldname;
 	size_t newsize;
 
-	newsize = strlen(newpath) + 1;
-	if (newsize == 1)
-		return -EINVAL;
-
 	/* if newpath EXISTS or oldpath doesn't exist we can't proceed */
-	pthread_rwlock_wrlock(&files_lock); /* list write lock */
-	if (get_file_by_path(newpath) != NULL) {
-		pthread_rwlock_unlock(&files_lock);
-		return -EEXIST;
-	} else if ((file = get_file_by_path(oldpath)) == NULL) {
+	pthread_rwlock_wrlock(&files_lock); /* tree write lock */
+	if ((file = get_file_by_path(oldpath)) == NULL || file == &root ||
+	    (parent = get_parent(newpath, &name)) == NULL) {
 		pthread_rwlock_unlock(&files_lock);
 		return -ENOENT;
 	}
+	if (is_reserved(parent, name) ||
+	    dir_lookup(parent->dir, name, strlen(name)) != NULL) {
+		pthread_rwlock_unlock(&files_lock);
+		return -EEXIST;
+	}
+
+	/* a directory can't be moved into itself */
+	for (p = parent; p; p = p->parent) {
+		if (p == file) {
+			pthread_rwlock_unlock(&files_lock);
+			return -EINVAL;
+		}
+	}
 
 	/*
-	 * note that to change path we need list and file write-locks held --
+	 * note that to change a name we need tree and file write-locks held --
 	 * that's because if one is searching by a file with get_file_by_path()
-	 * it wouldn't be possible to make sure path is not being changed during
-	 * the search -- with both locks path cannot be changed during a search
+	 * it wouldn't be possible to make sure the name is not being changed
+	 * during the search -- with both locks it cannot be changed during a
+	 * search
 	 */
 
 	pthread_rwlock_wrlock(&file->lock); /* file write lock */
 
-	file->path = realloc(file->path, newsize);
-	memcpy(file->path, newpath, newsize);
+	newsize = strlen(name) + 1;
+	if (mem_charge(MEM_LINKS, newsize)) {
+		pthread_rwlock_unlock(&file->lock);
+		pthread_rwlock_unlock(&files_lock);
+		return -ENOMEM;
+	}
+	if ((newname = malloc(newsize)) == NULL) {
+		mem_uncharge(MEM_LINKS, newsize);
+		pthread_rwlock_unlock(&file->lock);
+		pthread_rwlock_unlock(&files_lock);
+		return -ENOMEM;
+	}
+	memcpy(newname, name, newsize);
+
+	oldparent = file->parent;
+	oldname = file->name;
+	dir_del(oldparent->dir, file);
+	file->name = newname;
+
+	if (dir_add(parent->dir, file)) {
+		/* can't fail, it takes back the slot just freed */
+		file->name = oldname;
+		dir_add(oldparent->dir, file);
+
+		free(newname);
+		mem_uncharge(MEM_LINKS, newsize);
+		pthread_rwlock_unlock(&file->lock);
+		pthread_rwlock_unlock(&files_lock);
+		return -ENOMEM;
+	}
+	file->parent = parent;
+
+	mem_uncharge(MEM_LINKS, strlen(oldname) + 1);
+	free(oldname);
 
 	pthread_rwlock_unlock(&file->lock);
 	pthread_rwlock_unlock(&files_lock);
@@ -261,12 +818,53 @@ lion_rename(const char *oldpath, const char *newpath)
 	return 0;
 }
 
+/*
+ * read a link's data (see the note in lionfile_t about not needing the file
+ * lock) -- return the bytes read or -errno
+ */
+static int
+read_data(lionfile_t *file, char *buf, size_t size, off_t off)
+{
+	long long end = data_size(file);
+	size_t ret;
+
+	if (off >= end)
+		return 0;
+	if (off + (long long) size > end)
+		size = end - off;
+
+	if (file->seekable)
+		ret = seekable_read(file, buf, size, off);
+	else
+		ret = cache_read(file, buf, size, off);
+
+	return ret == (size_t) -1 ? -EIO : (int) ret;
+}
+
 static int
 lion_read(const char *path, char *buf, size_t size, off_t off,
 	  struct fuse_file_info *fi)
 {
 	lionfile_t *file;
-	size_t ret = 0;
+	const char *member;
+	int ret;
+
+	if (strcmp(path, STATS_PATH) == 0) {
+		char stats[STATS_SIZE];
+		int len = get_stats(stats, sizeof(stats));
+
+		if (off >= len)
+			return 0;
+		if (off + (off_t) size > len)
+			size = len - off;
+		memcpy(buf, stats + off, size);
+		return size;
+	}
+
+	/* a fakefile opened by lion_open() holds its link, skip the tree */
+	if (fi && fi->fh)
+		return read_data((lionfile_t*) (uintptr_t) fi->fh, buf, size,
+				 off);
 
 	/* we can't proceed if path is not a fakefile */
 	if (strncmp(path, "/.ff/", 5) != 0)
@@ -274,24 +872,196 @@ lion_read(const char *path, char *buf, size_t size, off_t off,
 	path += 4;
 
 	/* if file does not exist we can't proceed */
-	pthread_rwlock_rdlock(&files_lock); /* list read lock */
-	if ((file = get_file_by_path(path)) == NULL) {
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+	if ((file = get_file_in_path(path, &member)) == NULL ||
+	    (*member && !file->archive)) {
 		pthread_rwlock_unlock(&files_lock);
 		return -ENOENT;
 	}
+	if (file->dir || (file->archive && !*member)) {
+		pthread_rwlock_unlock(&files_lock);
+		return -EISDIR;
+	}
 
 	pthread_rwlock_rdlock(&file->lock); /* file read lock */
 	pthread_rwlock_unlock(&files_lock);
 
-	if (off < file->size) {
-		if(off + size > file->size)
-			size = file->size - off;
-	} else {
-		pthread_rwlock_unlock(&file->lock);
+	if (file->archive)
+		ret = archive_read(file, member, buf, size, off);
+	else
+		ret = read_data(file, buf, size, off);
+
+	pthread_rwlock_unlock(&file->lock);
+
+	return ret;
+}
+
+/*
+ * entries are paged: each one is given the offset of the next, which for a
+ * child is its directory slot (see dir.h) plus 3 -- offsets 1 and 2 come
+ * after "." and ".." -- so listing resumes where it stopped even if entries
+ * were added or removed in between
+ */
+static int
+lion_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+	     struct fuse_file_info *fi)
+{
+	lionfile_t *file, *child;
+	const char *member;
+	size_t slot;
+	int ret;
+
+	if (off < 1 && filler(buf, ".", NULL, 1))
+		return 0;
+	if (off < 2 && filler(buf, "..", NULL, 2))
+		return 0;
+
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+
+	/* the fakefile of an archive lists its members */
+	if (strncmp(path, "/.ff/", 5) == 0) {
+		if ((file = get_file_in_path(path + 4, &member)) == NULL ||
+		    (!file->dir && !file->archive)) {
+			pthread_rwlock_unlock(&files_lock);
+			return file ? -ENOTDIR : -ENOENT;
+		}
+		if (file->archive) {
+			pthread_rwlock_rdlock(&file->lock); /* file read lock */
+			pthread_rwlock_unlock(&files_lock);
+
+			ret = archive_readdir(file->archive, member, buf, filler,
+					      off);
+
+			pthread_rwlock_unlock(&file->lock);
+			return ret;
+		}
+		path += 4;
+	}
+
+	if ((file = get_file_by_path(path)) == NULL || !file->dir) {
+		pthread_rwlock_unlock(&files_lock);
+		return file ? -ENOTDIR : -ENOENT;
+	}
+
+	for (slot = off < 2 ? 0 : off - 2;
+	     (child = dir_next(file->dir, &slot)) != NULL; slot++)
+		if (filler(buf, child->name, NULL, slot + 3))
+			break;
+
+	pthread_rwlock_unlock(&files_lock);
+
+	return 0;
+}
+
+static int
+lion_open(const char *path, struct fuse_file_info *fi)
+{
+	lionfile_t *file;
+	const char *member;
+
+	/* statistics have no size known in advance */
+	if (strcmp(path, STATS_PATH) == 0) {
+		fi->direct_io = 1;
 		return 0;
 	}
 
-	ret = network_file_get_data(file->url, size, off, buf);
+	if (strncmp(path, "/.ff/", 5) != 0)
+		return 0;
+
+	/*
+	 * keep a reference to the link of a fakefile, so reads don't have to
+	 * look it up (archive members are still looked up by path)
+	 */
+	pthread_rwlock_rdlock(&files_lock); /* tree read lock */
+	if ((file = get_file_in_path(path + 4, &member)) != NULL &&
+	    !file->dir && !file->archive && !*member) {
+		__atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+		fi->fh = (uintptr_t) file;
+	}
+	pthread_rwlock_unlock(&files_lock);
+
+	return 0;
+}
+
+static int
+lion_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	if (fi->fh)
+		put_file((lionfile_t*) (uintptr_t) fi->fh);
+
+	return 0;
+}
+
+/*
+ * hints are given on the link or its fakefile (the kernel only allows user
+ * attributes on regular files and directories, so setting them through the
+ * link itself gets to the fakefile)
+ */
+/* an error for a path which isn't a link: `err` if it exists at all */
+static int
+not_a_link(const char *path, int err)
+{
+	struct stat st;
+
+	return lion_getattr(path, &st) == 0 ? err : -ENOENT;
+}
+
+static int
+is_lionfs_xattr(const char *name)
+{
+	return strcmp(name, XATTR_PREFETCH) == 0 ||
+	       strcmp(name, XATTR_PIN) == 0 || strcmp(name, XATTR_CACHED) == 0;
+}
+
+static int
+lion_setxattr(const char *path, const char *name, const char *value,
+	      size_t size, int flags)
+{
+	lionfile_t *file;
+	unsigned char key[CACHE_KEY_SIZE];
+	char str[64];
+	long long start, end;
+	int ret = 0;
+
+	if (size >= sizeof(str))
+		return -EINVAL;
+	memcpy(str, value, size);
+	str[size] = '\0';
+
+	/* links always have our attributes, and nothing else */
+	if ((flags & XATTR_CREATE) && is_lionfs_xattr(name))
+		return -EEXIST;
+	if ((flags & XATTR_REPLACE) && !is_lionfs_xattr(name))
+		return -ENODATA;
+
+	if ((file = get_link(path, 1)) == NULL)
+		return not_a_link(path, -ENOTSUP);
+
+	if (strcmp(name, XATTR_PREFETCH) == 0) {
+		if (parse_range(str, data_size(file), &start, &end))
+			ret = -EINVAL;
+		else if (prefetch_add(file, start, end))
+			ret = -ENOMEM;
+	} else if (strcmp(name, XATTR_PIN) == 0) {
+		data_key(file, key);
+		if (strcmp(str, "1") == 0 && !file->pinned) {
+			if (cache_pin(key))
+				ret = -ENOMEM;
+			else
+				file->pinned = 1;
+		} else if (strcmp(str, "0") == 0 && file->pinned) {
+			cache_unpin(key);
+			file->pinned = 0;
+		} else if (strcmp(str, "1") != 0 && strcmp(str, "0") != 0) {
+			ret = -EINVAL;
+		}
+	} else if (strcmp(name, XATTR_CACHED) == 0) {
+		ret = -EPERM;
+	} else {
+		ret = -ENOTSUP;
+	}
 
 	pthread_rwlock_unlock(&file->lock);
 
@@ -299,49 +1069,140 @@ lion_read(const char *path, char *buf, size_t size, off_t off,
 }
 
 static int
-lion_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
-	     struct fuse_file_info *fi)
+lion_getxattr(const char *path, const char *name, char *value, size_t size)
 {
 	lionfile_t *file;
-	int i;
+	char str[32];
+	long long resident, total;
+	int len;
+
+	if ((file = get_link(path, 0)) == NULL)
+		return not_a_link(path, -ENODATA);
+
+	if (strcmp(name, XATTR_PREFETCH) == 0) {
+		len = snprintf(str, sizeof(str), "%lld", prefetch_pending(file));
+	} else if (strcmp(name, XATTR_PIN) == 0) {
+		len = snprintf(str, sizeof(str), "%d", file->pinned);
+	} else if (strcmp(name, XATTR_CACHED) == 0) {
+		total = data_size(file);
+		resident = file->seekable ? seekable_resident(file) :
+			   cache_resident(file->key, 0,
+					  (total + CACHE_BLOCK - 1) / CACHE_BLOCK);
+		len = snprintf(str, sizeof(str), "%lld",
+			       total ? resident * 100 / total : 100);
+	} else {
+		pthread_rwlock_unlock(&file->lock);
+		return -ENODATA;
+	}
 
-	/* doesn't path equals "/" */
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
+	pthread_rwlock_unlock(&file->lock);
+
+	if (size == 0)
+		return len;
+	if (size < (size_t) len)
+		return -ERANGE;
+	memcpy(value, str, len);
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	return len;
+}
 
-	pthread_rwlock_rdlock(&files_lock); /* list read lock */
+static int
+lion_listxattr(const char *path, char *list, size_t size)
+{
+	static const char names[] = XATTR_PREFETCH "\0" XATTR_PIN "\0"
+				    XATTR_CACHED;
+	lionfile_t *file;
 
-	list_for_each_entry(file, &files, list_entry)
-		filler(buf, file->path + 1, NULL, 0);
+	if ((file = get_link(path, 0)) == NULL)
+		return not_a_link(path, 0); /* an empty list */
+	pthread_rwlock_unlock(&file->lock);
 
-	pthread_rwlock_unlock(&files_lock);
+	if (size == 0)
+		return sizeof(names);
+	if (size < sizeof(names))
+		return -ERANGE;
+	memcpy(list, names, sizeof(names));
+
+	return sizeof(names);
+}
+
+static int
+lion_removexattr(const char *path, const char *name)
+{
+	lionfile_t *file;
+	unsigned char key[CACHE_KEY_SIZE];
+
+	if (strcmp(name, XATTR_PIN) != 0)
+		return -ENODATA;
+
+	if ((file = get_link(path, 1)) == NULL)
+		return not_a_link(path, -ENODATA);
+
+	if (file->pinned) {
+		data_key(file, key);
+		cache_unpin(key);
+		file->pinned = 0;
+	}
+
+	pthread_rwlock_unlock(&file->lock);
 
 	return 0;
 }
 
+static void*
+lion_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	cache_init();
+	buf_init();
+	mem_init(options.mem_limit ? parse_size(options.mem_limit)
+				   : DEFAULT_MEM_LIMIT);
+	prefetch_init();
+
+	return NULL;
+}
+
 static struct fuse_operations fuseopr = {
 	.getattr = lion_getattr,
 	.readlink = lion_readlink,
+	.mkdir = lion_mkdir,
 	.unlink = lion_unlink,
+	.rmdir = lion_rmdir,
 	.symlink = lion_symlink,
 	.rename = lion_rename,
 	.read = lion_read,
 	.readdir = lion_readdir,
+	.open = lion_open,
+	.release = lion_release,
+	.setxattr = lion_setxattr,
+	.getxattr = lion_getxattr,
+	.listxattr = lion_listxattr,
+	.removexattr = lion_removexattr,
+	.init = lion_init,
 };
 
 int
 main(int argc, char **argv)
 {
-	int ret = 0;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded, ret = 0;
+
+	if (fuse_opt_parse(&args, &options, lion_opts, NULL) == -1)
+		return 1;
 
 	// init list rwlock
 	pthread_rwlock_init(&files_lock, NULL);
 
-	// init list
-	INIT_LIST_HEAD(&files);
+	// init tree
+	pthread_rwlock_init(&root.lock, NULL);
+	root.name = "";
+	root.mode = 0775;
+	root.mtime = time(NULL);
+	if ((root.dir = dir_new()) == NULL)
+		return 1;
 
 	// init network
 	network_init();
@@ -349,8 +1210,35 @@ main(int argc, char **argv)
 	// open all network modules available
 	network_open_all_modules();
 
+	// share the cache with other mounts of this host
+	if (options.shared_cache &&
+	    shared_init(options.shared_cache, options.shared_cache_size ?
+			parse_size(options.shared_cache_size) :
+			DEFAULT_SHARED_SIZE)) {
+		fprintf(stderr, "lionfs: can't use shared cache %s\n",
+			options.shared_cache);
+		return 1;
+	}
+
+	// init hedged reads over mirrors and batching of small reads
+	mirror_init(options.hedge);
+	batch_init(options.batch);
+
 	// Main routine. It initializes FUSE and set the operations (&fuseopr)
-	fuse_main(argc, argv, &fuseopr, NULL);
+	fuse = fuse_setup(args.argc, args.argv, &fuseopr, sizeof(fuseopr),
+			  &mountpoint, &multithreaded, NULL);
+	if (fuse == NULL) {
+		ret = 1;
+	} else {
+		// serve requests with our own workers unless -s was given
+		if (multithreaded)
+			ret = pool_loop(fuse, options.min_threads,
+					options.max_threads,
+					options.pin_cpus) ? 1 : 0;
+		else
+			ret = fuse_loop(fuse) ? 1 : 0;
+		fuse_teardown(fuse, mountpoint);
+	}
 
 	// close all network modules
 	network_close_all_modules();
@@ -358,5 +1246,7 @@ main(int argc, char **argv)
 	// destroy rwlock
 	pthread_rwlock_destroy(&files_lock);
 
+	fuse_opt_free_args(&args);
+
 	return ret;
 }
@@ -20,18 +20,41 @@
 #include <pthread.h>
 #include <sys/types.h>
 
-#include "linked_list.h"
+#include "mirror.h"
 
-typedef struct
+struct archive;
+struct liondir;
+struct seekable;
+
+typedef struct lionfile
 {
-	struct list_head list_entry;
+	struct lionfile *parent;
+	struct lionfile *hash_next; /* in parent's index, see dir.h */
+	size_t slot;                /* in parent's index, see dir.h */
 	pthread_rwlock_t lock;
+	/* the tree's reference and one per open fakefile, see put_file() */
+	int refs;
+	/*
+	 * to modify `name` you need tree and file write-locks held
+	 */
+	char *name;
+	/* children if this is a directory, NULL for a link */
+	struct liondir *dir;
+	int pinned; /* its data is kept in the cache, see lion_setxattr() */
 	/*
-	 * to modify `path` you need list and file write-locks held
+	 * what follows doesn't change once the file is in the tree, so it's
+	 * read through a reference without the file lock
 	 */
-	char *path;
-	char *url;
+	/* equivalent URLs, all validated to the same size and validator */
+	struct mirror *mirrors;
+	int nmirrors;
 	long long size;
+	/* identifies the remote file's data (see make_key()) */
+	unsigned char key[32];
 	mode_t mode;
 	time_t mtime; /* Last Modified */
+	/* member index if the link is viewed as an archive, see archive.h */
+	struct archive *archive;
+	/* frame index if the link is seekable compressed data, see seekable.h */
+	struct seekable *seekable;
 } lionfile_t;
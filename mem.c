@@ -0,0 +1,289 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Memory accounting.
+ *
+ * Every component charges the memory it holds to its class before using it.
+ * When a charge would take the total over the limit, the registered
+ * shrinkers (caches) are asked to free memory first. If that isn't enough,
+ * the charge fails -- except for in-flight buffers, which reads can't do
+ * without. Free buffers kept by the buffer pool are only accounted: the
+ * pool gives them back through its own shrinker, run after the caches so
+ * the buffers they free can go too.
+ *
+ * A monitor thread also watches the memory pressure of the host or of our
+ * cgroup (PSI, cgroup v2 memory.events and memory.max) and shrinks caches
+ * and throttles prefetch before the kernel runs out of memory.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+#define MAX_SHRINKERS 8
+
+/* some avg10 above this is pressure (percent of time stalled) */
+#define PSI_THRESHOLD 10.0
+
+/* memory.current above this fraction of memory.max is pressure */
+#define CGROUP_THRESHOLD 0.9
+
+/* seconds between pressure checks */
+#define MONITOR_INTERVAL 1
+
+static const char *class_names[MEM_NCLASSES] = {
+	[MEM_LINKS]    = "links",
+	[MEM_CACHE]    = "cache",
+	[MEM_INFLIGHT] = "inflight",
+	[MEM_PREFETCH] = "prefetch",
+	[MEM_POOL]     = "pool",
+};
+
+static size_t limit; /* 0 is no limit */
+static size_t total;
+static size_t usage[MEM_NCLASSES];
+static int pressure;
+
+static mem_shrinker_t shrinkers[MAX_SHRINKERS];
+static int nshrinkers;
+
+/* cgroup v2 directory of this process, empty if there's none */
+static char cgroup[256];
+static unsigned long long last_events;
+
+static void
+shrink(size_t want)
+{
+	size_t freed = 0;
+	int i;
+
+	for (i = 0; i < nshrinkers && freed < want; i++)
+		freed += shrinkers[i](want - freed);
+}
+
+/**
+ * mem_charge() Account `size` bytes to `class`. Return 0 on success or -1 if
+ * the limit would be exceeded.
+ */
+int
+mem_charge(enum mem_class class, size_t size)
+{
+	size_t new;
+
+	new = __atomic_add_fetch(&total, size, __ATOMIC_RELAXED);
+
+	/* the pool charges with its class locks held, it must not shrink */
+	if (limit && new > limit && class != MEM_INFLIGHT &&
+	    class != MEM_POOL) {
+		shrink(new - limit);
+
+		if (__atomic_load_n(&total, __ATOMIC_RELAXED) > limit) {
+			__atomic_sub_fetch(&total, size, __ATOMIC_RELAXED);
+			return -1;
+		}
+	}
+
+	__atomic_add_fetch(&usage[class], size, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void
+mem_uncharge(enum mem_class class, size_t size)
+{
+	__atomic_sub_fetch(&usage[class], size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&total, size, __ATOMIC_RELAXED);
+}
+
+/* Whether optional work (prefetching) should be held back */
+int
+mem_pressure(void)
+{
+	return __atomic_load_n(&pressure, __ATOMIC_RELAXED) ||
+	       (limit && __atomic_load_n(&total, __ATOMIC_RELAXED) > limit);
+}
+
+/* The limit in bytes, 0 if there's none */
+size_t
+mem_get_limit(void)
+{
+	return limit;
+}
+
+/* *must be called before mem_init() */
+void
+mem_register_shrinker(mem_shrinker_t shrinker)
+{
+	if (nshrinkers < MAX_SHRINKERS)
+		shrinkers[nshrinkers++] = shrinker;
+}
+
+int
+mem_print(char *buf, size_t len)
+{
+	int i, n;
+
+	n = snprintf(buf, len, "mem.limit %zu\nmem.total %zu\nmem.pressure %d\n",
+		     limit, __atomic_load_n(&total, __ATOMIC_RELAXED),
+		     __atomic_load_n(&pressure, __ATOMIC_RELAXED));
+
+	for (i = 0; i < MEM_NCLASSES && (size_t) n < len; i++)
+		n += snprintf(buf + n, len - n, "mem.%s %zu\n", class_names[i],
+			      __atomic_load_n(&usage[i], __ATOMIC_RELAXED));
+
+	return (size_t) n < len ? n : (int) len;
+}
+
+static int
+read_file(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	size_t n;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	n = fread(buf, 1, len - 1, f);
+	buf[n] = '\0';
+	fclose(f);
+
+	return 0;
+}
+
+static void
+find_cgroup(void)
+{
+	char buf[512], *path;
+	size_t len;
+
+	/* cgroup v2 has a single "0::<path>" line */
+	if (read_file("/proc/self/cgroup", buf, sizeof(buf)) ||
+	    strncmp(buf, "0::", 3) != 0)
+		return;
+
+	path = buf + 3;
+	path[strcspn(path, "\n")] = '\0';
+	if (strcmp(path, "/") == 0)
+		path = "";
+
+	/* a path too long for us is left alone, as if there was no cgroup */
+	len = strlen(path);
+	if (len + sizeof("/sys/fs/cgroup") > sizeof(cgroup))
+		return;
+	snprintf(cgroup, sizeof(cgroup), "/sys/fs/cgroup%s", path);
+}
+
+/* times the cgroup hit memory.high or memory.max */
+static unsigned long long
+cgroup_events(void)
+{
+	char path[320], buf[512], *p;
+	unsigned long long high = 0, max = 0;
+
+	snprintf(path, sizeof(path), "%s/memory.events", cgroup);
+	if (read_file(path, buf, sizeof(buf)))
+		return 0;
+
+	if ((p = strstr(buf, "high ")) != NULL)
+		sscanf(p, "high %llu", &high);
+	if ((p = strstr(buf, "\nmax ")) != NULL)
+		sscanf(p, "\nmax %llu", &max);
+
+	return high + max;
+}
+
+static int
+under_pressure(void)
+{
+	char path[320], buf[512];
+	unsigned long long events, current, cmax;
+	double avg10;
+
+	/* stall information, from our cgroup or from the whole system */
+	snprintf(path, sizeof(path), "%s/memory.pressure", cgroup);
+	if ((*cgroup && read_file(path, buf, sizeof(buf)) == 0) ||
+	    read_file("/proc/pressure/memory", buf, sizeof(buf)) == 0) {
+		if (sscanf(buf, "some avg10=%lf", &avg10) == 1 &&
+		    avg10 > PSI_THRESHOLD)
+			return 1;
+	}
+
+	if (!*cgroup)
+		return 0;
+
+	/* the cgroup hit memory.high or memory.max since last check */
+	if ((events = cgroup_events()) != last_events) {
+		last_events = events;
+		return 1;
+	}
+
+	/* the cgroup is close to memory.max */
+	snprintf(path, sizeof(path), "%s/memory.max", cgroup);
+	if (read_file(path, buf, sizeof(buf)) ||
+	    sscanf(buf, "%llu", &cmax) != 1)
+		return 0;
+	snprintf(path, sizeof(path), "%s/memory.current", cgroup);
+	if (read_file(path, buf, sizeof(buf)) ||
+	    sscanf(buf, "%llu", &current) != 1)
+		return 0;
+
+	return current > cmax * CGROUP_THRESHOLD;
+}
+
+static void*
+monitor(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		sleep(MONITOR_INTERVAL);
+
+		if (!under_pressure()) {
+			__atomic_store_n(&pressure, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* give back half of what the caches hold */
+		__atomic_store_n(&pressure, 1, __ATOMIC_RELAXED);
+		shrink(__atomic_load_n(&usage[MEM_CACHE], __ATOMIC_RELAXED) / 2);
+	}
+
+	return NULL;
+}
+
+/*
+ * Set the limit in bytes (0 is no limit) and start the pressure monitor --
+ * call it once FUSE is set up, so the thread survives daemonizing
+ */
+void
+mem_init(size_t bytes)
+{
+	pthread_t thread;
+
+	limit = bytes;
+
+	find_cgroup();
+	if (*cgroup)
+		last_events = cgroup_events();
+
+	if (pthread_create(&thread, NULL, monitor, NULL) == 0)
+		pthread_detach(thread);
+}
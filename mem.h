@@ -0,0 +1,52 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* components whose memory is accounted against the mount's limit */
+enum mem_class {
+	MEM_LINKS,    /* link table */
+	MEM_CACHE,    /* block cache */
+	MEM_INFLIGHT, /* buffers of reads being fetched */
+	MEM_PREFETCH, /* prefetch windows */
+	MEM_POOL,     /* free buffers kept by the buffer pool */
+	MEM_NCLASSES,
+};
+
+/* frees at least the requested bytes if it can, returns bytes freed */
+typedef size_t (*mem_shrinker_t)(size_t);
+
+int
+mem_charge(enum mem_class, size_t);
+
+void
+mem_uncharge(enum mem_class, size_t);
+
+int
+mem_pressure(void);
+
+size_t
+mem_get_limit(void);
+
+void
+mem_register_shrinker(mem_shrinker_t);
+
+int
+mem_print(char*, size_t);
+
+void
+mem_init(size_t);
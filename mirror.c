@@ -0,0 +1,621 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Hedged reads over equivalent mirrors.
+ *
+ * A read goes first to the mirror with the best observed throughput. If it
+ * hasn't completed once the learned latency percentile of that mirror's host
+ * has passed, a duplicate request is sent to the next mirror and whichever
+ * finishes first answers the read. The slower request is left to finish in
+ * the background, and its timing still feeds the statistics of its host.
+ *
+ * The first attempt reads straight into the caller's buffer, a hedge into
+ * a pooled buffer of its own. When a hedge wins, the caller is handed the
+ * hedge's buffer instead and the first attempt frees the caller's one when
+ * it's done with it -- so no answer is copied. Attempts run on threads kept
+ * for the life of the mount, in MIRROR_SLOTS slots allocated up front, and
+ * requests are recycled: a hedged read doesn't allocate or start threads.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "buf.h"
+#include "mirror.h"
+#include "modules/common.h"
+#include "network.h"
+
+#define LATENCY_SAMPLES 64
+
+/* recompute the hedge delay of a host every HEDGE_UPDATE samples */
+#define HEDGE_UPDATE 8
+
+/* hedge delay used until a host has HEDGE_UPDATE samples, and the lowest
+ * one used after that (in microseconds) */
+#define HEDGE_DEFAULT_DELAY 500000
+#define HEDGE_MIN_DELAY 1000
+
+/* a host which failed isn't tried first again for a back-off doubling
+ * with each failure in a row, in microseconds */
+#define HOST_BACKOFF_MIN 100000ULL
+#define HOST_BACKOFF_MAX 30000000
+
+/* attempts in flight (or waiting to be collected) at once, and threads */
+#define MIRROR_SLOTS 64
+
+/* attempts of a single read */
+#define MIRROR_ATTEMPTS 8
+
+struct host {
+	struct host *next;
+	char *name;
+	pthread_mutex_t lock;
+	/* ring of the last LATENCY_SAMPLES request latencies, microseconds */
+	unsigned int latency[LATENCY_SAMPLES];
+	unsigned int nsamples;
+	unsigned int hedge_delay;
+	/* exponentially weighted moving average, in bytes per second */
+	double throughput;
+	/* requests failed in a row, and when the last back-off ends */
+	unsigned int failures;
+	unsigned long long backoff_end;
+};
+
+struct attempt {
+	struct attempt *next; /* in the free slots or the queue */
+	struct request *req;
+	char *url; /* kept between uses, `url_size` bytes */
+	size_t url_size;
+	struct host *host;
+	struct nmodule *module;
+	void *buf;
+	int finished;
+};
+
+/* a read which may be in flight on several mirrors at once */
+struct request {
+	struct request *next; /* in the free requests */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int running; /* attempts not finished yet */
+	int done;    /* an attempt has answered, or the caller is gone */
+	int gone;    /* the caller has collected the answer */
+	size_t size;
+	long long off;
+	void *answer; /* buffer of the attempt which answered */
+	size_t ret;
+	struct attempt *attempts[MIRROR_ATTEMPTS];
+	int nattempts;
+};
+
+static struct host *hosts;
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* attempt slots and threads, and recycled requests */
+static struct attempt slots[MIRROR_SLOTS];
+static struct attempt *free_slots;
+static struct attempt *queue, **queue_tail = &queue;
+static struct request *free_requests;
+static int nthreads, idle_threads, queued;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slots_cond = PTHREAD_COND_INITIALIZER;
+
+/* 0 disables hedging (mirrors are then only used for failover) */
+static int hedge_percentile = 95;
+
+static unsigned long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* *assume host lock is held */
+static void
+update_hedge_delay(struct host *h)
+{
+	unsigned int sorted[LATENCY_SAMPLES];
+	unsigned int n;
+
+	n = h->nsamples < LATENCY_SAMPLES ? h->nsamples : LATENCY_SAMPLES;
+	memcpy(sorted, h->latency, n * sizeof(unsigned int));
+	qsort(sorted, n, sizeof(unsigned int), cmp_uint);
+
+	h->hedge_delay = sorted[(n - 1) * hedge_percentile / 100];
+	if (h->hedge_delay < HEDGE_MIN_DELAY)
+		h->hedge_delay = HEDGE_MIN_DELAY;
+}
+
+static void
+host_record(struct host *h, unsigned long long us, size_t bytes, int failed)
+{
+	unsigned long long backoff;
+	double rate;
+
+	pthread_mutex_lock(&h->lock);
+
+	if (failed) {
+		/* push the host down in the ranking, below every host which
+		 * answers until its back-off is over */
+		h->throughput /= 2;
+		backoff = h->failures < 16 ? HOST_BACKOFF_MIN << h->failures
+		                           : HOST_BACKOFF_MAX;
+		if (backoff > HOST_BACKOFF_MAX)
+			backoff = HOST_BACKOFF_MAX;
+		h->backoff_end = now_us() + backoff;
+		h->failures++;
+		pthread_mutex_unlock(&h->lock);
+		return;
+	}
+	h->failures = 0;
+
+	h->latency[h->nsamples++ % LATENCY_SAMPLES] = us;
+	if (h->nsamples % HEDGE_UPDATE == 0)
+		update_hedge_delay(h);
+
+	rate = bytes * 1000000.0 / (us ? us : 1);
+	h->throughput = h->throughput ? h->throughput * 0.8 + rate * 0.2 : rate;
+
+	pthread_mutex_unlock(&h->lock);
+}
+
+static unsigned int
+host_hedge_delay(struct host *h)
+{
+	unsigned int delay;
+
+	pthread_mutex_lock(&h->lock);
+	delay = h->nsamples >= HEDGE_UPDATE ? h->hedge_delay
+	                                    : HEDGE_DEFAULT_DELAY;
+	pthread_mutex_unlock(&h->lock);
+
+	return delay;
+}
+
+/*
+ * rank of a host, higher is better -- hosts never tried go first so that
+ * every mirror gets measured, hosts backing off after a failure last
+ */
+static double
+host_rank(struct host *h)
+{
+	double rank;
+
+	pthread_mutex_lock(&h->lock);
+	if (h->failures && now_us() < h->backoff_end)
+		rank = -1;
+	else if (h->nsamples || h->failures)
+		rank = h->throughput;
+	else
+		rank = 1e300;
+	pthread_mutex_unlock(&h->lock);
+
+	return rank;
+}
+
+/* hosts are identified by the "scheme://authority" part of the URL */
+static struct host*
+get_host(const char *url)
+{
+	struct host *h;
+	const char *end;
+	size_t len;
+
+	end = strstr(url, "://");
+	end = end ? strchr(end + 3, '/') : NULL;
+	len = end ? (size_t) (end - url) : strlen(url);
+
+	pthread_mutex_lock(&hosts_lock);
+
+	for (h = hosts; h; h = h->next)
+		if (strlen(h->name) == len && strncmp(h->name, url, len) == 0)
+			goto out;
+
+	if ((h = calloc(1, sizeof(struct host))) == NULL)
+		goto out;
+	if ((h->name = strndup(url, len)) == NULL) {
+		free(h);
+		h = NULL;
+		goto out;
+	}
+	pthread_mutex_init(&h->lock, NULL);
+	h->next = hosts;
+	hosts = h;
+
+out:
+	pthread_mutex_unlock(&hosts_lock);
+	return h;
+}
+
+/* a request of the free ones, or a new one */
+static struct request*
+get_request(void)
+{
+	pthread_condattr_t cattr;
+	struct request *req;
+
+	pthread_mutex_lock(&slots_lock);
+	if ((req = free_requests) != NULL)
+		free_requests = req->next;
+	pthread_mutex_unlock(&slots_lock);
+
+	if (req == NULL) {
+		if ((req = calloc(1, sizeof(struct request))) == NULL)
+			return NULL;
+		pthread_mutex_init(&req->lock, NULL);
+		pthread_condattr_init(&cattr);
+		pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+		pthread_cond_init(&req->cond, &cattr);
+		pthread_condattr_destroy(&cattr);
+	}
+
+	req->refs = 1;
+	req->running = 0;
+	req->done = 0;
+	req->gone = 0;
+	req->answer = NULL;
+	req->ret = -1;
+	req->nattempts = 0;
+
+	return req;
+}
+
+/*
+ * *assume request lock is held -- it is released here
+ * the last one puts the request and its attempt slots back
+ */
+static void
+put_request(struct request *req)
+{
+	int last = --req->refs == 0;
+	int i;
+
+	pthread_mutex_unlock(&req->lock);
+	if (!last)
+		return;
+
+	pthread_mutex_lock(&slots_lock);
+	for (i = 0; i < req->nattempts; i++) {
+		req->attempts[i]->next = free_slots;
+		free_slots = req->attempts[i];
+	}
+	req->next = free_requests;
+	free_requests = req;
+	pthread_mutex_unlock(&slots_lock);
+}
+
+static void
+run_attempt(struct attempt *a)
+{
+	struct request *req = a->req;
+	size_t size = req->size; /* req may be reused when freeing buf */
+	unsigned long long start;
+	void *buf = NULL;
+	size_t ret;
+
+	start = now_us();
+	ret = batch_get_data(a->module, a->url, size, req->off, a->buf);
+	host_record(a->host, now_us() - start, ret, ret == (size_t) -1);
+
+	pthread_mutex_lock(&req->lock);
+	a->finished = 1;
+	if (!req->done && ret != (size_t) -1) {
+		req->answer = a->buf;
+		req->ret = ret;
+		req->done = 1;
+	}
+	/* buffers of attempts finished before, the caller frees */
+	if (req->gone) {
+		buf = a->buf;
+		a->buf = NULL;
+	}
+	req->running--;
+	pthread_cond_signal(&req->cond);
+	put_request(req);
+
+	buf_free(buf, size);
+}
+
+static void*
+attempt_thread(void *arg)
+{
+	struct attempt *a;
+
+	(void) arg;
+
+	pthread_mutex_lock(&slots_lock);
+	for (;;) {
+		while (queue == NULL) {
+			idle_threads++;
+			pthread_cond_wait(&slots_cond, &slots_lock);
+			idle_threads--;
+		}
+		a = queue;
+		if ((queue = a->next) == NULL)
+			queue_tail = &queue;
+		queued--;
+		pthread_mutex_unlock(&slots_lock);
+
+		run_attempt(a);
+
+		pthread_mutex_lock(&slots_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * *assume request lock is held
+ * the URL is copied because a losing attempt may outlive its link. The
+ * attempt reads into `buf`, or a buffer of its own if NULL. Return 0 if it
+ * is started, or -1.
+ */
+static int
+start_attempt(struct request *req, struct mirror *m, void *buf)
+{
+	struct attempt *a;
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t len = strlen(m->url) + 1;
+	int own = buf == NULL;
+	char *url;
+
+	if (req->nattempts == MIRROR_ATTEMPTS)
+		return -1;
+
+	pthread_mutex_lock(&slots_lock);
+	if ((a = free_slots) != NULL)
+		free_slots = a->next;
+	pthread_mutex_unlock(&slots_lock);
+	if (a == NULL)
+		return -1;
+
+	if (len > a->url_size) {
+		if ((url = realloc(a->url, len)) == NULL)
+			goto error;
+		a->url = url;
+		a->url_size = len;
+	}
+	memcpy(a->url, m->url, len);
+	if (own && (buf = buf_alloc(req->size)) == NULL)
+		goto error;
+	a->buf = buf;
+	a->req = req;
+	a->host = m->host;
+	a->module = m->module;
+	a->finished = 0;
+	a->next = NULL;
+
+	pthread_mutex_lock(&slots_lock);
+
+	/* a thread for each attempt waiting, up to one a slot */
+	if (queued >= idle_threads && nthreads < MIRROR_SLOTS) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, attempt_thread, NULL) == 0)
+			nthreads++;
+		pthread_attr_destroy(&attr);
+	}
+	if (nthreads == 0) {
+		pthread_mutex_unlock(&slots_lock);
+		if (own)
+			buf_free(buf, req->size);
+		goto error;
+	}
+
+	*queue_tail = a;
+	queue_tail = &a->next;
+	queued++;
+	pthread_cond_signal(&slots_cond);
+
+	pthread_mutex_unlock(&slots_lock);
+
+	req->attempts[req->nattempts++] = a;
+	req->refs++;
+	req->running++;
+
+	return 0;
+
+error:
+	pthread_mutex_lock(&slots_lock);
+	a->next = free_slots;
+	free_slots = a;
+	pthread_mutex_unlock(&slots_lock);
+	return -1;
+}
+
+static void
+timespec_after_us(struct timespec *ts, unsigned int us)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+int
+mirror_set_url(struct mirror *m, const char *url)
+{
+	if ((m->module = network_find_module(url)) == NULL)
+		return -1;
+
+	if ((m->url = strdup(url)) == NULL)
+		return -1;
+
+	if ((m->host = get_host(url)) == NULL) {
+		free(m->url);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+mirror_free(struct mirror *m)
+{
+	free(m->url);
+}
+
+/* read from a single mirror, in the calling thread */
+static size_t
+read_mirror(struct mirror *m, size_t size, long long off, void *data)
+{
+	unsigned long long start = now_us();
+	size_t ret;
+
+	ret = batch_get_data(m->module, m->url, size, off, data);
+	host_record(m->host, now_us() - start, ret, ret == (size_t) -1);
+
+	return ret;
+}
+
+/**
+ * mirror_get_data() Read `size` bytes at `off` from any of `n` mirrors into
+ * `*data`, a buffer of `size` bytes from buf_alloc() -- which may be
+ * replaced by another such buffer holding the data. Return the number of
+ * bytes read or -1 on error.
+ */
+size_t
+mirror_get_data(struct mirror *mirrors, int n, size_t size, long long off,
+		void **data)
+{
+	struct request *req;
+	struct timespec deadline;
+	struct attempt *a;
+	int order[n];
+	int next = 0, hedged = 0;
+	int i, j, tmp;
+	size_t ret;
+
+	/* a single mirror has nothing to race against */
+	if (n == 1)
+		return read_mirror(&mirrors[0], size, off, *data);
+
+	/* rank mirrors by throughput (insertion sort, n is tiny) */
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+		for (j = i; j > 0 && host_rank(mirrors[order[j]].host) >
+		                     host_rank(mirrors[order[j - 1]].host); j--) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+	}
+
+	if ((req = get_request()) == NULL)
+		return read_mirror(&mirrors[order[0]], size, off, *data);
+	req->size = size;
+	req->off = off;
+
+	pthread_mutex_lock(&req->lock);
+
+	/* out of slots (or threads), read here without hedging */
+	if (start_attempt(req, &mirrors[order[next++]], *data)) {
+		req->done = 1;
+		req->gone = 1;
+		put_request(req);
+		return read_mirror(&mirrors[order[0]], size, off, *data);
+	}
+	timespec_after_us(&deadline, host_hedge_delay(mirrors[order[0]].host));
+
+	while (!req->done) {
+		if (req->running == 0) {
+			/* everything tried so far failed, fail over */
+			if (next == n)
+				break;
+			/* into the caller's buffer, nothing writes it now */
+			for (i = 0; i < req->nattempts; i++)
+				if (req->attempts[i]->buf == *data)
+					req->attempts[i]->buf = NULL;
+			start_attempt(req, &mirrors[order[next++]], *data);
+			continue;
+		}
+
+		if (hedged || next == n || hedge_percentile == 0) {
+			pthread_cond_wait(&req->cond, &req->lock);
+			continue;
+		}
+
+		if (pthread_cond_timedwait(&req->cond, &req->lock, &deadline)
+		    == ETIMEDOUT) {
+			start_attempt(req, &mirrors[order[next++]], NULL);
+			hedged = 1;
+		}
+	}
+
+	ret = req->done ? req->ret : (size_t) -1;
+	if (req->done)
+		*data = req->answer;
+
+	/*
+	 * free the buffers of finished attempts but the answer, those still
+	 * running free theirs -- the caller's one too if it lost
+	 */
+	for (i = 0; i < req->nattempts; i++) {
+		a = req->attempts[i];
+		if (a->finished && a->buf != *data) {
+			buf_free(a->buf, size);
+			a->buf = NULL;
+		}
+	}
+
+	/* from now on no attempt answers */
+	req->done = 1;
+	req->gone = 1;
+	put_request(req);
+
+	return ret;
+}
+
+/*
+ * Percentile of a host's latency after which a read is hedged, the attempt
+ * slots are set up here too
+ */
+void
+mirror_init(int percentile)
+{
+	int i;
+
+	if (percentile >= 0 && percentile <= 100)
+		hedge_percentile = percentile;
+
+	for (i = 0; i < MIRROR_SLOTS; i++) {
+		slots[i].next = free_slots;
+		free_slots = &slots[i];
+	}
+}
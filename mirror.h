@@ -0,0 +1,40 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+struct host;
+struct nmodule;
+
+/* one of the equivalent URLs a link can be read from */
+struct mirror {
+	char *url;
+	struct host *host; /* latency and throughput seen from url's host */
+	struct nmodule *module; /* serving url's scheme, see network.h */
+};
+
+int
+mirror_set_url(struct mirror*, const char*);
+
+void
+mirror_free(struct mirror*);
+
+size_t
+mirror_get_data(struct mirror*, int, size_t, long long, void**);
+
+void
+mirror_init(int);
@@ -17,9 +17,62 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <stdint.h>
 #include <sys/time.h>
 
 typedef struct {
 	long long size;
 	time_t mtime;
+	char etag[128]; /* validator, empty if the server sent none */
 } lionfile_info_t;
+
+/* one piece of a multi-range read, see get_ranges() in modules */
+struct lion_range {
+	long long off;
+	size_t size;
+	void *data;
+};
+
+/*
+ * services lionfs offers to modules, handed to module_init() if the module
+ * has it -- buffers from alloc() are given back to free() with their size
+ */
+struct lion_host {
+	void*
+	(*alloc)(size_t);
+
+	void
+	(*free)(void*, size_t);
+
+	/* update a checksum with more data, the checksum of nothing is 0 */
+	uint32_t
+	(*crc32c)(uint32_t, const void*, size_t);
+
+	uint32_t
+	(*crc32)(uint32_t, const void*, size_t);
+};
+
+/*
+ * what a module exports as `lion_module`: its name, the URL schemes it
+ * serves (NULL-terminated) and its entry points -- get_ranges and init
+ * may be NULL
+ */
+struct lion_module {
+	const char *name;
+	const char *const *schemes;
+
+	size_t
+	(*get_data)(void*, char*, long long, size_t);
+
+	int
+	(*get_valid)(char*);
+
+	int
+	(*get_info)(lionfile_info_t*, char*);
+
+	int
+	(*get_ranges)(struct lion_range*, int, char*);
+
+	int
+	(*init)(struct lion_host*);
+};
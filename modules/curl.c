@@ -1,34 +1,480 @@
 // lionfs, The Link Over Network File System
 // Copyright (C) 2021  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
 
+#define _GNU_SOURCE /* memmem() */
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <curl/curl.h>
+#include <openssl/evp.h>
 
 #include "common.h"
 
+// Tunables, read from the environment when the module is first used:
+//
+//   LIONFS_HTTP_VERSION      "1.1", "2" (default) or "3". HTTP/2 is only
+//                            negotiated over TLS; HTTP/3 falls back to
+//                            HTTP/2 when libcurl was built without it.
+//   LIONFS_HTTP_STREAMS      Maximum concurrent streams multiplexed over
+//                            one HTTP/2 or HTTP/3 connection (default 100).
+//   LIONFS_HTTP_CONNECTIONS  Maximum connections per host (default 0, no
+//                            limit). Useful to size an HTTP/1.1 pool.
+//   LIONFS_HTTP_CA_BUNDLE    File of CA certificates to verify servers
+//                            with, instead of libcurl's default (e.g. a
+//                            mirror with a self-signed certificate).
+static long http_version = CURL_HTTP_VERSION_2TLS;
+static long max_streams = 100;
+static long max_host_connections = 0;
+static char *ca_bundle;
+
+// Receive buffer of a range transfer. With libcurl's default (16 KiB), a
+// stream of a busy HTTP/2 connection now and then gets stuck with its data
+// received but never handed over; none did from 256 KiB up (bench/http).
+#define RECV_BUFFER (256 * 1024L)
+// A transfer getting no data for this long (seconds) is given up, and
+// fetched once more like one cut short
+#define STALL_TIMEOUT 30L
+
+// All transfers are driven by a single multi handle owned by `multi_thread`,
+// so concurrent range reads to the same host share one connection instead of
+// paying a TCP and TLS handshake each.
+static CURLM *multi;
+static pthread_t multi_thread;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 static int is_curl_initialized = 0;
+static volatile int quit = 0;
+
+// `pending` and each transfer's `done` are protected by `lock`
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+struct transfer {
+	CURL *easy;
+	char *buf;
+	long long off;
+	size_t size;
+	size_t pos;
+	long code;
+	char content_type[256];
+	char content_range[128];
+	// Digests of the whole file the server sent, base64
+	char checksum_crc32c[16];
+	char checksum_crc32[16];
+	char content_md5[32];
+	int corrupt;
+	CURLcode result;
+	int done;
+	struct transfer *next;
+};
+
+static struct transfer *pending;
+
+static void*
+default_alloc(size_t size)
+{
+	return malloc(size);
+}
+
 static void
-ensure_curl_initialized()
+default_free(void *buf, size_t size)
+{
+	(void) size;
+
+	free(buf);
+}
+
+// Buffer allocator of lionfs, see module_init()
+static struct lion_host host = {
+	.alloc = default_alloc,
+	.free = default_free,
+};
+
+static long
+env_long(const char *name, long def)
+{
+	char *value = getenv(name);
+	return value && *value ? strtol(value, NULL, 10) : def;
+}
+
+static void
+read_tunables(void)
 {
-	if (!is_curl_initialized) {
-		curl_global_init(CURL_GLOBAL_DEFAULT);
-		is_curl_initialized = 1;
+	char *version = getenv("LIONFS_HTTP_VERSION");
+
+	if (version && strcmp(version, "1.1") == 0) {
+		http_version = CURL_HTTP_VERSION_1_1;
+	} else if (version && strcmp(version, "3") == 0) {
+		if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3)
+			http_version = CURL_HTTP_VERSION_3;
 	}
+
+	max_streams = env_long("LIONFS_HTTP_STREAMS", max_streams);
+	max_host_connections = env_long("LIONFS_HTTP_CONNECTIONS",
+	                                max_host_connections);
+	ca_bundle = getenv("LIONFS_HTTP_CA_BUNDLE");
+	if (ca_bundle && !*ca_bundle)
+		ca_bundle = NULL;
+}
+
+static void
+finish_transfers(void)
+{
+	CURLMsg *msg;
+	int left;
+
+	while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+		struct transfer *t;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &t);
+		curl_multi_remove_handle(multi, msg->easy_handle);
+
+		pthread_mutex_lock(&lock);
+		t->result = msg->data.result;
+		t->done = 1;
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void*
+multi_loop(void *arg)
+{
+	long timeout;
+	int running;
+
+	(void) arg;
+
+	while (!quit) {
+		struct transfer *t;
+
+		// Handles can only be added by the thread driving `multi`
+		pthread_mutex_lock(&lock);
+		t = pending;
+		pending = NULL;
+		pthread_mutex_unlock(&lock);
+
+		for (; t; t = t->next)
+			curl_multi_add_handle(multi, t->easy);
+
+		curl_multi_perform(multi, &running);
+		finish_transfers();
+
+		// Sleep until there is socket activity or get_data() wakes us.
+		// Data of HTTP/2 streams already read off the socket is only
+		// signalled by the timer: polling then stalls the stream.
+		curl_multi_timeout(multi, &timeout);
+		if (timeout != 0)
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
+	}
+
+	return NULL;
+}
+
+static void
+init_curl(void)
+{
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	read_tunables();
+
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+	                  max_host_connections);
+
+	if (pthread_create(&multi_thread, NULL, multi_loop, NULL) != 0) {
+		curl_multi_cleanup(multi);
+		return;
+	}
+
+	is_curl_initialized = 1;
+}
+
+static int
+ensure_curl_initialized()
+{
+	pthread_once(&init_once, init_curl);
+	return is_curl_initialized ? 0 : -1;
+}
+
+__attribute__((destructor)) static void
+cleanup_curl(void)
+{
+	if (!is_curl_initialized)
+		return;
+
+	quit = 1;
+	curl_multi_wakeup(multi);
+	pthread_join(multi_thread, NULL);
+	curl_multi_cleanup(multi);
+	curl_global_cleanup();
 }
 
 static size_t
 copy_helper(void *src, size_t size, size_t nmemb, void *dst)
 {
-	if (dst)
-		memcpy(dst, src, size * nmemb);
-	return size * nmemb;
+	struct transfer *t = dst;
+	size_t len = size * nmemb;
+	long code = 0;
+
+	// A server ignoring our Range header sends the whole file from its
+	// beginning, which is useless unless that's where we want to read
+	curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 206 && t->off > 0)
+		return 0;
+
+	// Stop the transfer once the buffer is full
+	if (len > t->size - t->pos)
+		len = t->size - t->pos;
+
+	memcpy(t->buf + t->pos, src, len);
+	t->pos += len;
+
+	return len;
+}
+
+// If the header line in `buf` is `name`, keep its value in `value`
+static void
+keep_header(const char *buf, size_t len, const char *name, char *value,
+            size_t size)
+{
+	size_t n = strlen(name);
+
+	if (len <= n || strncasecmp(buf, name, n) != 0)
+		return;
+
+	for (buf += n, len -= n; len && (*buf == ' ' || *buf == '\t'); len--)
+		buf++;
+
+	snprintf(value, size, "%.*s", (int) strcspn(buf, "\r\n"), buf);
+}
+
+// Keep the Content-Range and digest headers of a range request
+static size_t
+range_header_helper(char *buf, size_t size, size_t nmemb, void *dst)
+{
+	struct transfer *t = dst;
+	size_t len = size * nmemb;
+
+	keep_header(buf, len, "content-range:", t->content_range,
+	            sizeof(t->content_range));
+	keep_header(buf, len, "x-amz-checksum-crc32c:", t->checksum_crc32c,
+	            sizeof(t->checksum_crc32c));
+	keep_header(buf, len, "x-amz-checksum-crc32:", t->checksum_crc32,
+	            sizeof(t->checksum_crc32));
+	keep_header(buf, len, "content-md5:", t->content_md5,
+	            sizeof(t->content_md5));
+
+	return len;
+}
+
+// Decode base64 `in` to `out`. Return the number of bytes decoded or -1 if
+// `in` isn't base64 or doesn't fit.
+static int
+base64_decode(const char *in, unsigned char *out, int size)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int bits = 0;
+	int nbits = 0, n = 0;
+	const char *d;
+
+	for (; *in && *in != '='; in++) {
+		if ((d = strchr(digits, *in)) == NULL)
+			return -1;
+		bits = (bits << 6) | (d - digits);
+		nbits += 6;
+		if (nbits >= 8) {
+			if (n == size)
+				return -1;
+			nbits -= 8;
+			out[n++] = bits >> nbits;
+		}
+	}
+
+	return n;
+}
+
+// Compare a base64 big-endian CRC sent by the server to `crc`. Return -1 if
+// they differ, 0 if they match or the value can't be understood (such as a
+// checksum of a multipart upload's parts).
+static int
+check_crc(const char *value, uint32_t crc)
+{
+	unsigned char sent[4];
+
+	if (base64_decode(value, sent, 4) != 4)
+		return 0;
+
+	return ((uint32_t) sent[0] << 24 | sent[1] << 16 | sent[2] << 8 |
+	        sent[3]) == crc ? 0 : -1;
+}
+
+static int
+check_md5(const char *value, const void *data, size_t len)
+{
+	unsigned char sent[16], md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+
+	if (base64_decode(value, sent, 16) != 16 ||
+	    !EVP_Digest(data, len, md, &mdlen, EVP_md5(), NULL))
+		return 0;
+
+	return memcmp(sent, md, 16) == 0 ? 0 : -1;
+}
+
+// Check a finished transfer was not cut short, and when it holds the whole
+// file, check it against the digests the server sent. Return -1 if not.
+static int
+check_transfer(struct transfer *t)
+{
+	long long first, last, total = -1;
+	curl_off_t length;
+
+	if (t->code == 206) {
+		if (sscanf(t->content_range, "bytes %lld-%lld/%lld", &first,
+		           &last, &total) < 2)
+			return 0; // multipart, see parse_multipart()
+
+		// Less than the server announced, and than we wanted
+		if (t->pos < t->size && (long long) t->pos < last - first + 1)
+			return -1;
+
+		if (first != 0 || last != total - 1)
+			return 0;
+	} else if (curl_easy_getinfo(t->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+	                             &length) == CURLE_OK) {
+		total = length;
+	}
+
+	if (total < 0 || (long long) t->pos != total)
+		return 0;
+
+	if (*t->checksum_crc32c && host.crc32c &&
+	    check_crc(t->checksum_crc32c, host.crc32c(0, t->buf, t->pos)))
+		return -1;
+	if (*t->checksum_crc32 && host.crc32 &&
+	    check_crc(t->checksum_crc32, host.crc32(0, t->buf, t->pos)))
+		return -1;
+	if (*t->content_md5 && check_md5(t->content_md5, t->buf, t->pos))
+		return -1;
+
+	return 0;
+}
+
+// Keep the ETag header as the file's validator
+static size_t
+header_helper(char *buf, size_t size, size_t nmemb, void *dst)
+{
+	lionfile_info_t *info = dst;
+	size_t len = size * nmemb;
+
+	if (len > 5 && strncasecmp(buf, "etag:", 5) == 0) {
+		char *value = buf + 5;
+		size_t n = len - 5;
+
+		while (n && (*value == ' ' || *value == '\t')) {
+			value++;
+			n--;
+		}
+		while (n && (value[n - 1] == '\r' || value[n - 1] == '\n' ||
+		             value[n - 1] == ' '))
+			n--;
+		if (n >= sizeof(info->etag))
+			n = sizeof(info->etag) - 1;
+
+		memcpy(info->etag, value, n);
+		info->etag[n] = '\0';
+	}
+
+	return len;
+}
+
+// Set up a request for `range` of `uri`, hand it to the multi thread and
+// wait for it to finish. Return 0 on success.
+static int
+perform_range(struct transfer *t, char *uri, const char *range)
+{
+	char *content_type = NULL;
+	int ret = -1;
+
+	t->easy = curl_easy_init();
+	if (!t->easy)
+		return -1;
+
+	// Set URL and the portion of the file to get
+	if (curl_easy_setopt(t->easy, CURLOPT_URL, uri) != CURLE_OK ||
+	    curl_easy_setopt(t->easy, CURLOPT_RANGE, range) != CURLE_OK)
+		goto cleanup;
+	if (ca_bundle)
+		curl_easy_setopt(t->easy, CURLOPT_CAINFO, ca_bundle);
+
+	// Wait for an existing connection to multiplex on rather than opening
+	// a new one for each request started before the first one is set up
+	curl_easy_setopt(t->easy, CURLOPT_HTTP_VERSION, http_version);
+	if (http_version != CURL_HTTP_VERSION_1_1)
+		curl_easy_setopt(t->easy, CURLOPT_PIPEWAIT, 1L);
+
+	// Set the callbacks when headers and data arrive
+	curl_easy_setopt(t->easy, CURLOPT_HEADERFUNCTION, range_header_helper);
+	curl_easy_setopt(t->easy, CURLOPT_HEADERDATA, t);
+	curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, copy_helper);
+	curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(t->easy, CURLOPT_PRIVATE, t);
+
+	curl_easy_setopt(t->easy, CURLOPT_BUFFERSIZE, RECV_BUFFER);
+	curl_easy_setopt(t->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(t->easy, CURLOPT_LOW_SPEED_TIME, STALL_TIMEOUT);
+
+	// Hand the request to the multi thread and wait for it
+	pthread_mutex_lock(&lock);
+	t->next = pending;
+	pending = t;
+	pthread_mutex_unlock(&lock);
+
+	curl_multi_wakeup(multi);
+
+	pthread_mutex_lock(&lock);
+	while (!t->done)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	if (t->result == CURLE_OPERATION_TIMEDOUT)
+		t->corrupt = 1;
+
+	// A write error after the buffer is full is our own early stop
+	if (t->result != CURLE_OK &&
+	    !(t->result == CURLE_WRITE_ERROR && t->pos == t->size))
+		goto cleanup;
+
+	curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &t->code);
+	curl_easy_getinfo(t->easy, CURLINFO_CONTENT_TYPE, &content_type);
+	if (content_type)
+		snprintf(t->content_type, sizeof(t->content_type), "%s",
+		         content_type);
+
+	if (check_transfer(t)) {
+		t->corrupt = 1;
+		goto cleanup;
+	}
+
+	ret = 0;
+
+cleanup:
+	curl_easy_cleanup(t->easy);
+	return ret;
 }
 
 /**
- * get_data() Read from a file pointed by URI over network.
+ * get_data() Read from a file pointed by URI over network. Return the number
+ * of bytes read or -1 on error.
  *
  * @p data Pointer where to store read data.
  * @p uri 'http://' URI to a file over network.
@@ -38,42 +484,177 @@ copy_helper(void *src, size_t size, size_t nmemb, void *dst)
 size_t
 get_data(void *data, char *uri, long long off, size_t size)
 {
-	ensure_curl_initialized();
+	if (ensure_curl_initialized())
+		return -1;
 
-	CURL *curl = curl_easy_init();
-	if (!curl)
+	char range[64];
+	snprintf(range, 64, "%lld-%lld", off, (off + size) - 1);
+
+	// Data damaged or cut short on the way is fetched once more
+	for (int tries = 0; tries < 2; tries++) {
+		struct transfer t = {
+			.buf = data,
+			.off = off,
+			.size = size,
+		};
+
+		if (perform_range(&t, uri, range) == 0)
+			return t.pos;
+		if (!t.corrupt)
+			break;
+	}
+
+	return -1;
+}
+
+// Copy the part of the file in `part` (which starts at file offset `start`)
+// to every range it fully covers
+static void
+fill_ranges(struct lion_range *ranges, int n, char *filled, const char *part,
+            long long start, size_t len)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (ranges[i].off < start ||
+		    ranges[i].off + (long long) ranges[i].size > start + (long long) len)
+			continue;
+
+		memcpy(ranges[i].data, part + (ranges[i].off - start),
+		       ranges[i].size);
+		filled[i] = 1;
+	}
+}
+
+// Split a multipart/byteranges body into its parts
+static void
+parse_multipart(struct transfer *t, struct lion_range *ranges, int n,
+                char *filled)
+{
+	char delimiter[128];
+	char *boundary, *p, *end, *line, *eol;
+	long long first, last;
+	size_t dlen;
+
+	if ((boundary = strstr(t->content_type, "boundary=")) == NULL)
+		return;
+	boundary += 9;
+	if (*boundary == '"')
+		boundary++;
+	dlen = snprintf(delimiter, sizeof(delimiter), "--%.*s",
+	                (int) strcspn(boundary, "\";\r\n "), boundary);
+	if (dlen >= sizeof(delimiter))
+		return;
+
+	p = t->buf;
+	end = t->buf + t->pos;
+
+	while ((p = memmem(p, end - p, delimiter, dlen)) != NULL) {
+		p += dlen;
+		if (end - p < 2 || strncmp(p, "--", 2) == 0)
+			break;
+
+		// Part headers end with an empty line
+		first = last = -1;
+		for (line = p; (eol = memmem(line, end - line, "\r\n", 2)); ) {
+			if (strncasecmp(line, "content-range:", 14) == 0)
+				sscanf(line + 14, " bytes %lld-%lld", &first, &last);
+			line = eol + 2;
+			if (line + 2 <= end && strncmp(line, "\r\n", 2) == 0)
+				break;
+		}
+		if (!eol || line + 2 > end)
+			break;
+		p = line + 2;
+
+		if (first < 0 || last < first || end - p < last - first + 1)
+			break;
+
+		fill_ranges(ranges, n, filled, p, first, last - first + 1);
+		p += last - first + 1;
+	}
+}
+
+/**
+ * get_ranges() Read several ranges of a file with a single multi-range
+ * request. Return 0 if every range was filled or -1 otherwise.
+ *
+ * @p ranges Ranges to read, sorted by offset and not overlapping.
+ * @p n Number of ranges.
+ * @p uri 'http://' URI to a file over network.
+ */
+int
+get_ranges(struct lion_range *ranges, int n, char *uri)
+{
+	if (ensure_curl_initialized())
 		return -1;
 
-	int ret = 0;
+	char *range = host.alloc(n * 44);
+	char *filled = host.alloc(n);
+	size_t total = 0, len = 0;
+	int i, ret = -1;
 
-	// Set URL
-	ret = curl_easy_setopt(curl, CURLOPT_URL, uri);
-	if (ret != CURLE_OK)
-		goto error;
+	struct transfer t = {
+		.off = ranges[0].off,
+	};
 
-	// Set the portion of the file to get
-	char range[64];
-	snprintf(range, 64, "%lld-%lld", off, (off + size) - 1);
-	ret = curl_easy_setopt(curl, CURLOPT_RANGE, range);
-	if (ret != CURLE_OK)
-		goto error;
+	if (!range || !filled)
+		goto out;
+	memset(filled, 0, n);
 
-	// Set the callback when request finishes
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, copy_helper);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, data); // passed as dst in memcpy()
+	for (i = 0; i < n; i++) {
+		len += sprintf(range + len, "%s%lld-%lld", i ? "," : "",
+		               ranges[i].off, ranges[i].off + (long long) ranges[i].size - 1);
+		total += ranges[i].size;
+	}
 
-	// Do the request
-	ret = curl_easy_perform(curl);
-	if (ret != CURLE_OK)
-		goto error;
+	// Leave room for the headers and delimiter of each part
+	t.size = total + (n + 1) * 256;
+	if ((t.buf = host.alloc(t.size)) == NULL)
+		goto out;
 
-cleanup:
-	curl_easy_cleanup(curl);
+	if (perform_range(&t, uri, range))
+		goto out;
+
+	if (t.code == 206 && strncasecmp(t.content_type, "multipart/byteranges",
+	                                 20) == 0) {
+		parse_multipart(&t, ranges, n, filled);
+	} else {
+		// Servers may coalesce the ranges into one, or send the whole
+		// file when starting at 0
+		long long first = 0;
+
+		if (t.code == 206 &&
+		    sscanf(t.content_range, "bytes %lld-", &first) != 1)
+			goto out;
+		fill_ranges(ranges, n, filled, t.buf, first, t.pos);
+	}
+
+	for (i = 0; i < n && filled[i]; i++)
+		;
+	if (i == n)
+		ret = 0;
+
+out:
+	if (t.buf)
+		host.free(t.buf, t.size);
+	if (filled)
+		host.free(filled, n);
+	if (range)
+		host.free(range, n * 44);
 	return ret;
+}
 
-error:
-	ret = -ret;
-	goto cleanup;
+/**
+ * module_init() Use the buffer allocator of lionfs from now on. Return 0.
+ *
+ * @p h Services offered by lionfs.
+ */
+int
+module_init(struct lion_host *h)
+{
+	host = *h;
+	return 0;
 }
 
 /**
@@ -85,14 +666,14 @@ error:
 int
 get_valid(char *uri)
 {
-	ensure_curl_initialized();
-	return 0;
+	return ensure_curl_initialized();
 }
 
 int
 get_info(lionfile_info_t *info, char *uri)
 {
-	ensure_curl_initialized();
+	if (ensure_curl_initialized())
+		return -1;
 
 	CURL *curl = curl_easy_init();
 	if (!curl)
@@ -108,6 +689,11 @@ get_info(lionfile_info_t *info, char *uri)
 	// Set the option for returning size and last-mofified time
 	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
 	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, http_version);
+	if (ca_bundle)
+		curl_easy_setopt(curl, CURLOPT_CAINFO, ca_bundle);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_helper);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, info);
 
 	// Do the request
 	ret = curl_easy_perform(curl);
@@ -129,6 +715,20 @@ cleanup:
 	return ret;
 
 error:
-	ret = -ret;
+	// network_file_get_info() only takes -1 as failure, and a size
+	// under 1 leaves ret at CURLE_OK
+	ret = -1;
 	goto cleanup;
 }
+
+static const char *const schemes[] = { "http", "https", NULL };
+
+const struct lion_module lion_module = {
+	.name = "curl",
+	.schemes = schemes,
+	.get_data = get_data,
+	.get_valid = get_valid,
+	.get_info = get_info,
+	.get_ranges = get_ranges,
+	.init = module_init,
+};
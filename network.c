@@ -17,230 +17,353 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <assert.h>
+/*
+ * Network modules.
+ *
+ * A module exports a `lion_module` descriptor (see modules/common.h) with
+ * the URL schemes it serves. Modules (files named *.so) are looked for in
+ * the directories of LIONFS_MODULE_PATH (separated by ':'), then in
+ * `./modules/` and `lionfs/modules/`; a scheme is served by the first
+ * module declaring it.
+ * With LION_STATIC_MODULES, the cURL module is linked into the program and
+ * registered before any other.
+ *
+ * A URL is resolved to its module once, when a link is created (see struct
+ * mirror), and reads go straight to the module from there.
+ */
+
+#include <dirent.h>
 #include <dlfcn.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
+#include "buf.h"
+#include "crc.h"
 #include "modules/common.h"
+#include "network.h"
 
-struct nmodule {
-	const char *scheme;
-	const char *filename;
-	void *handle;
+#define MAX_MODULES 16
+#define MAX_SCHEMES 64
+
+/* Define max URL scheme size, '\0' included */
+#define SCHEME_SIZE 16
 
-	size_t
-	(*func_get_data)(void*, char*, long long, size_t);
+#define PATH_SIZE 4096
 
-	int
-	(*func_get_valid)(char*);
+struct nmodule {
+	const struct lion_module *ops;
+	void *handle; /* NULL if linked into the program */
+};
 
-	int
-	(*func_get_info)(lionfile_info_t*, char*);
+struct scheme {
+	char name[SCHEME_SIZE];
+	struct nmodule *module;
 };
 
-static struct nmodule modules[] = {
-	{ "http",  "curl", },
-	{ "https", "curl", },
-	{ NULL, },
+#ifdef LION_STATIC_MODULES
+/* the cURL module, see modules/curl.c */
+extern const struct lion_module lion_module;
+
+size_t
+get_data(void*, char*, long long, size_t);
+#endif
+
+static struct lion_host host = {
+	.alloc = buf_alloc,
+	.free = buf_free,
+	.crc32c = crc32c,
+	.crc32 = crc32_ieee,
 };
 
-static inline void
-clean_pointers(struct nmodule *nm)
+static struct nmodule modules[MAX_MODULES];
+static int nmodules;
+
+static struct scheme schemes[MAX_SCHEMES];
+static int nschemes;
+
+/* time taken to load the modules, and URLs resolved to a module */
+static unsigned long long load_us;
+static unsigned long long lookups;
+
+static unsigned long long
+now_ns(void)
 {
-	nm->func_get_data  = NULL;
-	nm->func_get_valid = NULL;
-	nm->func_get_info  = NULL;
-	return;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+static struct nmodule*
+find_module_by_scheme(const char *scheme)
+{
+	int i;
+
+	for (i = 0; i < nschemes; i++)
+		if (strcmp(schemes[i].name, scheme) == 0)
+			return schemes[i].module;
+
+	return NULL;
+}
+
+/* add a module and the schemes it serves not taken yet by another one */
 static int
-load_syms(struct nmodule *nm)
+register_module(const struct lion_module *ops, void *handle)
 {
-	if ((nm->func_get_data = dlsym(nm->handle, "get_data")) == NULL)
-		return -1;
+	struct nmodule *nm;
+	int i;
 
-	if ((nm->func_get_valid = dlsym(nm->handle, "get_valid")) == NULL)
+	if (nmodules == MAX_MODULES || !ops->get_data || !ops->get_valid ||
+	    !ops->get_info || !ops->schemes)
 		return -1;
 
-	if ((nm->func_get_info = dlsym(nm->handle, "get_info")) == NULL)
+	for (i = 0; i < nmodules; i++)
+		if (modules[i].ops && (modules[i].ops == ops ||
+		    strcmp(modules[i].ops->name, ops->name) == 0))
+			return -1; /* the same module found again */
+
+	if (ops->init && ops->init(&host))
 		return -1;
 
+	nm = &modules[nmodules++];
+	nm->ops = ops;
+	nm->handle = handle;
+
+	for (i = 0; ops->schemes[i] && nschemes < MAX_SCHEMES; i++) {
+		if (strlen(ops->schemes[i]) >= SCHEME_SIZE ||
+		    find_module_by_scheme(ops->schemes[i]))
+			continue;
+		strcpy(schemes[nschemes].name, ops->schemes[i]);
+		schemes[nschemes].module = nm;
+		nschemes++;
+	}
+
 	return 0;
 }
 
-static int
+static void
 close_module(struct nmodule *nm)
 {
-	if (!nm->handle)
-		return -1;
+	if (nm->handle)
+		dlclose(nm->handle);
+
+	nm->ops = NULL;
+	nm->handle = NULL;
+}
+
+/* Load the module in a file -- return 0 or -1 if it isn't one */
+int
+network_open_module(const char *path)
+{
+	const struct lion_module *ops;
+	void *handle;
 
-	if (dlclose(nm->handle))
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
 		return -1;
 
-	clean_pointers(nm);
+	if ((ops = dlsym(handle, "lion_module")) == NULL ||
+	    register_module(ops, handle)) {
+		dlclose(handle);
+		return -1;
+	}
 
 	return 0;
 }
 
-#define PATH_SIZE 4096
+/* load every module (a regular file named *.so) in a directory */
+static void
+open_modules_in(const char *dir)
+{
+	char path[PATH_SIZE];
+	struct dirent *d;
+	struct stat st;
+	size_t len;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+
+	while ((d = readdir(dp)) != NULL) {
+		len = strlen(d->d_name);
+		if (d->d_name[0] == '.' || len < 4 ||
+		    strcmp(d->d_name + len - 3, ".so") != 0)
+			continue;
+		snprintf(path, PATH_SIZE, "%s/%s", dir, d->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			network_open_module(path);
+	}
 
-static int
-open_module(struct nmodule *nm)
+	closedir(dp);
+}
+
+void
+network_open_all_modules(void)
 {
-	assert(nm != NULL);
+	unsigned long long start = now_ns();
+	char *env, *dir, *saveptr;
+
+#ifdef LION_STATIC_MODULES
+	register_module(&lion_module, NULL);
+#endif
+
+	if ((env = getenv("LIONFS_MODULE_PATH")) != NULL &&
+	    (env = strdup(env)) != NULL) {
+		for (dir = strtok_r(env, ":", &saveptr); dir;
+		     dir = strtok_r(NULL, ":", &saveptr))
+			open_modules_in(dir);
+		free(env);
+	}
 
-	char tmp_path[PATH_SIZE];
+	open_modules_in("./modules");
+	open_modules_in("lionfs/modules");
 
-	if (nm->handle)
-		/* module was already opened or user didn't call
-		 * network_init() function */
-		return -1;
+	load_us = (now_ns() - start) / 1000;
+}
 
-	/* try to open module */
-	snprintf(tmp_path, PATH_SIZE, "lionfs/modules/%s", nm->filename);
-	if ((nm->handle = dlopen(tmp_path, RTLD_NOW)) == NULL) {
-		snprintf(tmp_path, PATH_SIZE, "./modules/%s", nm->filename);
-		if ((nm->handle = dlopen(tmp_path, RTLD_NOW)) == NULL)
-			return -1;
-	}
+/* Close the module named `name` */
+int
+network_close_module(const char *name)
+{
+	int i, j;
 
-	if (load_syms(nm) == -1) {
-		close_module(nm); /* we've already opened the module */
-		return -1;
+	for (i = 0; i < nmodules; i++) {
+		if (!modules[i].ops || strcmp(modules[i].ops->name, name) != 0)
+			continue;
+
+		/* its schemes aren't served anymore */
+		for (j = 0; j < nschemes; j++)
+			if (schemes[j].module == &modules[i])
+				schemes[j--] = schemes[--nschemes];
+
+		close_module(&modules[i]);
+		return 0;
 	}
+
+	return -1;
 }
 
-static struct nmodule*
-find_module_by_scheme(const char *scheme)
+void
+network_close_all_modules(void)
 {
 	int i;
 
-	for (i = 0; modules[i].scheme; i++)
-		if(strcmp(modules[i].scheme, scheme) == 0)
-			return &modules[i];
+	for (i = 0; i < nmodules; i++)
+		close_module(&modules[i]);
 
-	return NULL;
+	nmodules = 0;
+	nschemes = 0;
 }
 
-/* Define max URL scheme size.
- * Scheme size is: "http://" = 4 Bytes + '\0' = 5 Bytes) */
-#define SCHEME_SIZE 8
-
-static struct nmodule*
-find_module_by_url(const char *url)
+/**
+ * network_find_module() Resolve the module serving a URL's scheme. Return
+ * NULL if there's none.
+ */
+struct nmodule*
+network_find_module(const char *url)
 {
-	int i;
+	struct nmodule *nm = NULL;
 	char scheme[SCHEME_SIZE];
+	int i;
 
 	for (i = 0; url[i] && i < SCHEME_SIZE; i++) {
 		scheme[i] = url[i];
 		if (url[i] == ':') {
 			scheme[i] = '\0';
-			return find_module_by_scheme(scheme);
+			nm = find_module_by_scheme(scheme);
+			break;
 		}
 	}
 
-	return NULL;
+	__atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+
+	return nm;
 }
 
 size_t
-network_file_get_data(char *url, size_t size, long long off, void *data)
+network_get_data(struct nmodule *nm, char *url, size_t size, long long off,
+		 void *data)
 {
-	struct nmodule *nm;
-
-	if ((nm = find_module_by_url(url)) == NULL)
-		return 0;
+	if (!nm->ops)
+		return -1; /* closed */
 
-	if (!nm->func_get_data)
-		return 0;
+#ifdef LION_STATIC_MODULES
+	/* a direct call for the module linked in */
+	if (nm->ops == &lion_module)
+		return get_data(data, url, off, size);
+#endif
 
-	return nm->func_get_data(data, url, off, size);
+	return nm->ops->get_data(data, url, off, size);
 }
 
+/* Read several ranges at once -- return 0 if all of them were read */
 int
-network_file_get_valid(char *url)
+network_get_ranges(struct nmodule *nm, char *url, struct lion_range *ranges,
+		   int n)
 {
-	struct nmodule *nm;
-
-	if ((nm = find_module_by_url(url)) == NULL)
+	if (!nm->ops || !nm->ops->get_ranges)
 		return -1;
 
-	if (!nm->func_get_valid)
-		return -1;
-
-	return nm->func_get_valid(url);
+	return nm->ops->get_ranges(ranges, n, url);
 }
 
-int
-network_file_get_info(char *url, lionfile_info_t *file_info)
+size_t
+network_file_get_data(char *url, size_t size, long long off, void *data)
 {
 	struct nmodule *nm;
 
-	memset((void*) file_info, 0, sizeof(lionfile_info_t));
-
-	if ((nm = find_module_by_url(url)) == NULL)
-		return -1;
-
-	if (!nm->func_get_info)
-		return -1;
-
-	if (nm->func_get_info(file_info, url) == -1)
-		return -1;
+	if ((nm = network_find_module(url)) == NULL)
+		return 0;
 
-	return 0;
+	return network_get_data(nm, url, size, off, data);
 }
 
 int
-network_open_module(const char *name)
+network_file_get_valid(char *url)
 {
 	struct nmodule *nm;
 
-	if ((nm = find_module_by_scheme(name)) == NULL)
+	if ((nm = network_find_module(url)) == NULL)
 		return -1;
 
-	return open_module(nm);
-}
-
-void
-network_open_all_modules(void)
-{
-	int i;
-
-	for (i = 0; modules[i].scheme; i++)
-		open_module(&modules[i]);
-
-	return;
+	return nm->ops->get_valid(url);
 }
 
 int
-network_close_module(const char *name)
+network_file_get_info(char *url, lionfile_info_t *file_info)
 {
 	struct nmodule *nm;
 
-	if((nm = find_module_by_scheme(name)) == NULL)
+	memset((void*) file_info, 0, sizeof(lionfile_info_t));
+
+	if ((nm = network_find_module(url)) == NULL)
+		return -1;
+
+	if (nm->ops->get_info(file_info, url) == -1)
 		return -1;
 
-	return close_module(nm);
+	return 0;
 }
 
-void
-network_close_all_modules(void)
+int
+network_print(char *buf, size_t len)
 {
-	int i;
+	int n;
 
-	for (i = 0; modules[i].scheme; i++)
-		close_module(&modules[i]);
+	n = snprintf(buf, len, "net.modules %d\nnet.schemes %d\n"
+		     "net.load_us %llu\nnet.lookups %llu\n",
+		     nmodules, nschemes, load_us,
+		     __atomic_load_n(&lookups, __ATOMIC_RELAXED));
 
-	return;
+	return (size_t) n < len ? n : (int) len;
 }
 
 /* Before all, we should call this function! */
 void
 network_init(void)
 {
-	int i;
-
-	for (i = 0; modules[i].scheme; i++)
-		clean_pointers(&modules[i]);
+	nmodules = 0;
+	nschemes = 0;
 }
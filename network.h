@@ -17,6 +17,21 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+struct nmodule;
+
+/* Reads through a module resolved beforehand */
+
+struct nmodule*
+network_find_module(const char*);
+
+size_t
+network_get_data(struct nmodule*, char*, size_t, long long, void*);
+
+int
+network_get_ranges(struct nmodule*, char*, struct lion_range*, int);
+
+/* Requests resolving the URL's module each time */
+
 size_t
 network_file_get_data(char*, size_t, long long, void*);
 
@@ -40,5 +55,8 @@ network_close_module(const char*);
 void
 network_close_all_modules(void);
 
+int
+network_print(char*, size_t);
+
 void
 network_init(void);
@@ -0,0 +1,241 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Worker pool serving FUSE requests.
+ *
+ * It replaces fuse_loop_mt() to give control over the workers: at least
+ * `min` of them are kept, more are started while all are busy (up to
+ * `max`), and extra ones exit when enough others are idle. Workers can be
+ * pinned to CPUs, one after the other, so their caches stay warm.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "linked_list.h"
+#include "pool.h"
+
+struct worker {
+	struct list_head list;
+	pthread_t thread;
+	char *buf;
+};
+
+struct pool {
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	size_t bufsize;
+	pthread_mutex_t lock;
+	struct list_head workers;
+	int nworkers;
+	int idle;
+	int min, max;
+	int pin;
+	cpu_set_t cpus; /* we may run on, workers are pinned in turn */
+	int next_cpu;
+	int error;
+	sem_t finish; /* posted when the loop has to end */
+};
+
+static struct pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int start_worker(void);
+
+/* *assume pool lock is held -- the worker must not be running anymore */
+static void
+free_worker(struct worker *w)
+{
+	list_del(&w->list);
+	pool.nworkers--;
+	free(w->buf);
+	free(w);
+}
+
+static void*
+worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct fuse_buf fbuf;
+	struct fuse_chan *ch;
+	int res;
+
+	while (!fuse_session_exited(pool.se)) {
+		fbuf.mem = w->buf;
+		fbuf.size = pool.bufsize;
+		fbuf.flags = 0;
+		ch = pool.ch;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf(pool.se, &fbuf, &ch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0) {
+				pool.error = res;
+				fuse_session_exit(pool.se);
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.idle == 0 && pool.nworkers < pool.max)
+			start_worker();
+		pthread_mutex_unlock(&pool.lock);
+
+		fuse_session_process_buf(pool.se, &fbuf, ch);
+
+		pthread_mutex_lock(&pool.lock);
+		/* enough others are waiting for requests, leave */
+		if (pool.nworkers > pool.min && pool.idle >= pool.min) {
+			free_worker(w);
+			pthread_detach(pthread_self());
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+		pool.idle++;
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	sem_post(&pool.finish);
+	return NULL;
+}
+
+/* *assume pool lock is held */
+static int
+start_worker(void)
+{
+	struct worker *w;
+	sigset_t set, old;
+	cpu_set_t cpus;
+	int ret;
+
+	if ((w = calloc(1, sizeof(struct worker))) == NULL)
+		return -1;
+	if ((w->buf = malloc(pool.bufsize)) == NULL) {
+		free(w);
+		return -1;
+	}
+
+	/* signals are left to the main thread, see pool_loop() */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&w->thread, NULL, worker_thread, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		free(w->buf);
+		free(w);
+		return -1;
+	}
+
+	if (pool.pin) {
+		while (!CPU_ISSET(pool.next_cpu, &pool.cpus))
+			pool.next_cpu = (pool.next_cpu + 1) % CPU_SETSIZE;
+		CPU_ZERO(&cpus);
+		CPU_SET(pool.next_cpu, &cpus);
+		pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus);
+		pool.next_cpu = (pool.next_cpu + 1) % CPU_SETSIZE;
+	}
+
+	list_add(&w->list, &pool.workers);
+	pool.nworkers++;
+	pool.idle++;
+
+	return 0;
+}
+
+/**
+ * pool_loop() Serve requests with a pool of `min` to `max` workers, pinned
+ * to CPUs if `pin`. Return 0 when the file system is unmounted, or -1.
+ */
+int
+pool_loop(struct fuse *fuse, int min, int max, int pin)
+{
+	struct worker *w;
+	int i;
+
+	pool.se = fuse_get_session(fuse);
+	pool.ch = fuse_session_next_chan(pool.se, NULL);
+	pool.bufsize = fuse_chan_bufsize(pool.ch);
+	pool.min = min > 0 ? min : 1;
+	pool.max = max > pool.min ? max : pool.min;
+	pool.pin = pin && sched_getaffinity(0, sizeof(pool.cpus), &pool.cpus) == 0
+		   && CPU_COUNT(&pool.cpus) > 0;
+	INIT_LIST_HEAD(&pool.workers);
+	sem_init(&pool.finish, 0, 0);
+
+	pthread_mutex_lock(&pool.lock);
+	for (i = 0; i < pool.min; i++)
+		start_worker();
+	i = pool.nworkers;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (i == 0)
+		return -1;
+
+	/* a signal (see fuse_set_signal_handlers()) interrupts this */
+	while (!fuse_session_exited(pool.se))
+		sem_wait(&pool.finish);
+
+	pthread_mutex_lock(&pool.lock);
+	list_for_each_entry(w, &pool.workers, list)
+		pthread_cancel(w->thread);
+	while (!list_empty(&pool.workers)) {
+		w = list_entry(pool.workers.next, struct worker, list);
+		pthread_mutex_unlock(&pool.lock);
+		pthread_join(w->thread, NULL);
+		pthread_mutex_lock(&pool.lock);
+		free_worker(w);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	sem_destroy(&pool.finish);
+	fuse_session_reset(pool.se);
+
+	return pool.error ? -1 : 0;
+}
+
+int
+pool_print(char *buf, size_t len)
+{
+	int n;
+
+	pthread_mutex_lock(&pool.lock);
+	n = snprintf(buf, len, "pool.workers %d\npool.idle %d\n",
+		     pool.nworkers, pool.idle);
+	pthread_mutex_unlock(&pool.lock);
+
+	return (size_t) n < len ? n : (int) len;
+}
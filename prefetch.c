@@ -0,0 +1,258 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cache warmup.
+ *
+ * Ranges of links asked to be prefetched are queued and read into the cache
+ * by a background thread, PREFETCH_CHUNK bytes at a time and taking turns
+ * between the queued ranges. The buffer is charged to MEM_PREFETCH, and
+ * prefetching is held back while there is memory pressure.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "cache.h"
+#include "linked_list.h"
+#include "lionfs.h"
+#include "mem.h"
+#include "prefetch.h"
+#include "seekable.h"
+
+#define PREFETCH_CHUNK (1024 * 1024)
+
+/* microseconds to wait before checking the memory pressure again */
+#define PREFETCH_BACKOFF 100000
+
+struct prefetch {
+	struct list_head list;
+	lionfile_t *file;
+	long long off;
+	long long end;
+};
+
+static struct list_head queue;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* range the worker is reading, out of the queue meanwhile */
+static struct prefetch *current;
+static int cancelled;
+static pthread_cond_t current_done = PTHREAD_COND_INITIALIZER;
+
+static unsigned long long pending, done;
+
+/*
+ * read a chunk at the start of [off, end) into the cache, the data itself
+ * is thrown away -- return the bytes read, or -1 to give up on the range
+ */
+static long long
+prefetch_chunk(lionfile_t *file, long long off, long long end, char *buf)
+{
+	size_t size = PREFETCH_CHUNK, ret;
+	long long file_end;
+
+	pthread_rwlock_rdlock(&file->lock); /* file read lock */
+
+	file_end = file->seekable ? seekable_size(file->seekable) : file->size;
+	if (end > file_end)
+		end = file_end;
+	if (off + (long long) size > end)
+		size = end > off ? end - off : 0;
+
+	ret = file->seekable ? seekable_read(file, buf, size, off)
+			     : cache_read(file, buf, size, off);
+
+	pthread_rwlock_unlock(&file->lock);
+
+	return size && ret && ret != (size_t) -1 ? (long long) ret : -1;
+}
+
+static void*
+worker(void *arg)
+{
+	struct prefetch *p;
+	long long n;
+	char *buf;
+
+	(void) arg;
+
+	if ((buf = buf_alloc(PREFETCH_CHUNK)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&queue_lock);
+
+	for (;;) {
+		while (list_empty(&queue))
+			pthread_cond_wait(&queue_cond, &queue_lock);
+
+		p = list_entry(queue.next, struct prefetch, list);
+		list_del(&p->list);
+		current = p;
+
+		pthread_mutex_unlock(&queue_lock);
+
+		/* wait for memory, unless the range is cancelled meanwhile */
+		for (;;) {
+			if (!mem_pressure() &&
+			    mem_charge(MEM_PREFETCH, PREFETCH_CHUNK) == 0) {
+				n = prefetch_chunk(p->file, p->off, p->end,
+						   buf);
+				mem_uncharge(MEM_PREFETCH, PREFETCH_CHUNK);
+				pthread_mutex_lock(&queue_lock);
+				break;
+			}
+
+			pthread_mutex_lock(&queue_lock);
+			if (cancelled) {
+				n = 0; /* dropped below */
+				break;
+			}
+			pthread_mutex_unlock(&queue_lock);
+
+			usleep(PREFETCH_BACKOFF);
+		}
+
+		if (n < 0 || n > p->end - p->off)
+			n = p->end - p->off;
+		p->off += n;
+		pending -= n;
+		done += n;
+
+		/* take turns with the other ranges */
+		if (p->off < p->end && !cancelled) {
+			list_add(&p->list, queue.prev);
+		} else {
+			pending -= p->end - p->off;
+			free(p);
+		}
+
+		current = NULL;
+		cancelled = 0;
+		pthread_cond_broadcast(&current_done);
+	}
+
+	return NULL;
+}
+
+/**
+ * prefetch_add() Queue bytes [off, end) of a link to be read into the cache.
+ * Return 0 or -1 if there's no memory.
+ */
+int
+prefetch_add(lionfile_t *file, long long off, long long end)
+{
+	struct prefetch *p;
+
+	if (off >= end)
+		return 0;
+
+	if ((p = malloc(sizeof(struct prefetch))) == NULL)
+		return -1;
+	p->file = file;
+	p->off = off;
+	p->end = end;
+
+	pthread_mutex_lock(&queue_lock);
+	list_add(&p->list, queue.prev);
+	pending += end - off;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+/* Bytes of a link still to be prefetched */
+long long
+prefetch_pending(lionfile_t *file)
+{
+	struct prefetch *p;
+	long long n = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	list_for_each_entry(p, &queue, list)
+		if (p->file == file)
+			n += p->end - p->off;
+	if (current && current->file == file && !cancelled)
+		n += current->end - current->off;
+	pthread_mutex_unlock(&queue_lock);
+
+	return n;
+}
+
+/*
+ * Drop the ranges queued for a link and wait until the worker is done with
+ * it -- call it once the link is out of the tree, before freeing it
+ */
+void
+prefetch_cancel(lionfile_t *file)
+{
+	struct list_head *pos, *next;
+	struct prefetch *p;
+
+	pthread_mutex_lock(&queue_lock);
+
+	for (pos = queue.next; pos != &queue; pos = next) {
+		next = pos->next;
+		p = list_entry(pos, struct prefetch, list);
+		if (p->file == file) {
+			list_del(&p->list);
+			pending -= p->end - p->off;
+			free(p);
+		}
+	}
+
+	/* the range being read is dropped by the worker */
+	if (current && current->file == file) {
+		cancelled = 1;
+		while (current && current->file == file)
+			pthread_cond_wait(&current_done, &queue_lock);
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+}
+
+int
+prefetch_print(char *buf, size_t len)
+{
+	int n;
+
+	pthread_mutex_lock(&queue_lock);
+	n = snprintf(buf, len, "prefetch.pending %llu\nprefetch.done %llu\n",
+		     pending, done);
+	pthread_mutex_unlock(&queue_lock);
+
+	return (size_t) n < len ? n : (int) len;
+}
+
+/* Start the worker, after FUSE has daemonized */
+void
+prefetch_init(void)
+{
+	pthread_t thread;
+
+	INIT_LIST_HEAD(&queue);
+
+	if (pthread_create(&thread, NULL, worker, NULL) == 0)
+		pthread_detach(thread);
+}
@@ -0,0 +1,518 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Seekable compressed links.
+ *
+ * A gzip file made of independent members -- such as the BGZF files written
+ * by `bgzip` -- can be read from any member boundary. Given the index of
+ * those boundaries (the `.gzi` file `bgzip -i` writes next to the data),
+ * a read at an uncompressed offset is mapped to the members (frames) that
+ * hold it, only those are fetched, and they are inflated in parallel by the
+ * reading thread and helpers (see tasks.c). The inflated frames are kept in
+ * the block cache under a key of their own.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "buf.h"
+#include "cache.h"
+#include "lionfs.h"
+#include "mem.h"
+#include "modules/common.h"
+#include "network.h"
+#include "seekable.h"
+#include "tasks.h"
+
+/* appended to the link's URL to get the index */
+#define INDEX_SUFFIX ".gzi"
+
+/* frames inflating to more than this aren't served (nor cached) */
+#define FRAME_MAX (1024 * 1024)
+
+/* tells inflated frames from the link's raw blocks in the cache */
+#define FRAMES_KEY 0x5eeca61ef4a3e5ULL
+
+/* empty BGZF block marking the end of the file */
+static const unsigned char bgzf_eof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+	0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/* where a frame starts, compressed and uncompressed */
+struct frame {
+	long long coff;
+	long long uoff;
+};
+
+struct seekable {
+	/* `n` frames and one more entry with the end offsets */
+	struct frame *frames;
+	size_t n;
+	size_t charged; /* to MEM_LINKS */
+};
+
+/* helpers a single read takes at most */
+#define JOB_HELPERS 16
+
+/* a run of frames fetched with a single request and inflated in parallel */
+struct job {
+	pthread_mutex_t lock;
+	pthread_cond_t done;     /* signalled when no helper runs it anymore */
+	int helpers;             /* submitted and not done */
+	struct seekable *sk;
+	const unsigned char *key;
+	size_t first, last, next;
+	const unsigned char *in; /* compressed data of the run */
+	char *buf;               /* where the caller wants [off, off + size) */
+	size_t size;
+	long long off;
+	int failed;
+};
+
+static unsigned long long
+le64(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+/* read exactly `size` bytes of the link at `off` -- return 0 if so */
+static int
+read_raw(struct lionfile *file, long long off, size_t size, void *buf)
+{
+	void *data;
+	int ret = -1;
+
+	if ((data = buf_alloc(size)) == NULL)
+		return -1;
+	if (mirror_get_data(file->mirrors, file->nmirrors, size, off, &data)
+	    == size) {
+		memcpy(buf, data, size);
+		ret = 0;
+	}
+	buf_free(data, size);
+
+	return ret;
+}
+
+/* fetch the whole index file, return its size or -1 */
+static long long
+get_index(const char *url, unsigned char **data)
+{
+	lionfile_info_t info;
+	char index_url[strlen(url) + sizeof(INDEX_SUFFIX)];
+
+	strcpy(index_url, url);
+	strcat(index_url, INDEX_SUFFIX);
+
+	if (network_file_get_valid(index_url) ||
+	    network_file_get_info(index_url, &info) ||
+	    info.size < 8 || info.size > 64 * 1024 * 1024)
+		return -1;
+
+	if ((*data = malloc(info.size)) == NULL)
+		return -1;
+	if (network_file_get_data(index_url, info.size, 0, *data)
+	    != (size_t) info.size) {
+		free(*data);
+		return -1;
+	}
+
+	return info.size;
+}
+
+/*
+ * fill the frame table from a .gzi index: a little-endian count followed by
+ * the (compressed, uncompressed) offsets of every frame but the first
+ */
+static int
+parse_index(struct lionfile *file, struct seekable *sk,
+	    const unsigned char *data, long long len)
+{
+	unsigned char tail[sizeof(bgzf_eof)];
+	long long end = file->size;
+	unsigned long long count;
+	size_t i;
+
+	count = le64(data);
+	if (count > (unsigned long long) (len - 8) / 16)
+		return -1;
+
+	/* the frame table, plus the end marker and the end of the file */
+	if ((sk->frames = malloc((count + 3) * sizeof(struct frame))) == NULL)
+		return -1;
+
+	sk->frames[0].coff = 0;
+	sk->frames[0].uoff = 0;
+	for (i = 1; i <= count; i++) {
+		sk->frames[i].coff = le64(data + 8 + (i - 1) * 16);
+		sk->frames[i].uoff = le64(data + 16 + (i - 1) * 16);
+		if (sk->frames[i].coff <= sk->frames[i - 1].coff ||
+		    sk->frames[i].uoff < sk->frames[i - 1].uoff ||
+		    sk->frames[i].coff >= file->size)
+			return -1;
+	}
+	sk->n = count + 1;
+
+	/* the index may leave the end marker out, make it a frame then */
+	if (file->size >= (long long) sizeof(bgzf_eof) &&
+	    read_raw(file, file->size - sizeof(tail), sizeof(tail), tail) == 0 &&
+	    memcmp(tail, bgzf_eof, sizeof(tail)) == 0 &&
+	    sk->frames[sk->n - 1].coff < file->size - (long long) sizeof(tail)) {
+		end = file->size - sizeof(tail);
+		sk->frames[sk->n].coff = end;
+		sk->n++;
+	}
+
+	/* the last data frame ends with its uncompressed size (ISIZE) */
+	if (read_raw(file, end - 4, 4, tail))
+		return -1;
+	i = end == file->size ? sk->n - 1 : sk->n - 2;
+	sk->frames[i + 1].uoff = sk->frames[i].uoff +
+		(tail[0] | tail[1] << 8 | tail[2] << 16 |
+		 (unsigned long) tail[3] << 24);
+	sk->frames[sk->n].coff = file->size;
+	sk->frames[sk->n].uoff = sk->frames[i + 1].uoff;
+
+	for (i = 0; i < sk->n; i++)
+		if (sk->frames[i + 1].uoff - sk->frames[i].uoff > FRAME_MAX)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * seekable_open() Return the frame index of a link to seekable compressed
+ * data, or NULL if it isn't such a link.
+ */
+struct seekable*
+seekable_open(struct lionfile *file)
+{
+	struct seekable *sk;
+	unsigned char magic[3], *data;
+	long long len;
+
+	if (file->size < 18 || read_raw(file, 0, sizeof(magic), magic) ||
+	    magic[0] != 0x1f || magic[1] != 0x8b || magic[2] != 8)
+		return NULL;
+
+	if ((len = get_index(file->mirrors[0].url, &data)) < 0)
+		return NULL;
+
+	if ((sk = calloc(1, sizeof(struct seekable))) == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	if (parse_index(file, sk, data, len)) {
+		free(data);
+		seekable_free(sk);
+		return NULL;
+	}
+	free(data);
+
+	sk->charged = sizeof(struct seekable) +
+		      (sk->n + 1) * sizeof(struct frame);
+	if (mem_charge(MEM_LINKS, sk->charged)) {
+		sk->charged = 0;
+		seekable_free(sk);
+		return NULL;
+	}
+
+	return sk;
+}
+
+void
+seekable_free(struct seekable *sk)
+{
+	if (sk->charged)
+		mem_uncharge(MEM_LINKS, sk->charged);
+	free(sk->frames);
+	free(sk);
+}
+
+/* Size of the uncompressed data */
+long long
+seekable_size(struct seekable *sk)
+{
+	return sk->frames[sk->n].uoff;
+}
+
+/* Key the inflated frames of a link are cached under (CACHE_KEY_SIZE) */
+void
+seekable_key(struct lionfile *file, unsigned char *key)
+{
+	unsigned long long k;
+
+	memcpy(key, file->key, CACHE_KEY_SIZE);
+	memcpy(&k, key, sizeof(k));
+	k ^= FRAMES_KEY;
+	memcpy(key, &k, sizeof(k));
+}
+
+/* Bytes of a link's uncompressed data in the cache */
+long long
+seekable_resident(struct lionfile *file)
+{
+	unsigned char key[CACHE_KEY_SIZE];
+
+	seekable_key(file, key);
+	return cache_resident(key, 0, file->seekable->n);
+}
+
+/* index of the frame holding uncompressed offset `off` */
+static size_t
+find_frame(struct seekable *sk, long long off)
+{
+	size_t lo = 0, hi = sk->n, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (sk->frames[mid].uoff <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * inflate frame `i` (one or more gzip members) to `out`, which has room for
+ * a byte more than the frame should inflate to -- return 0 if ok
+ */
+static int
+inflate_frame(struct seekable *sk, size_t i, const unsigned char *in,
+	      char *out)
+{
+	size_t csize = sk->frames[i + 1].coff - sk->frames[i].coff;
+	size_t usize = sk->frames[i + 1].uoff - sk->frames[i].uoff;
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return -1;
+
+	zs.next_in = (unsigned char*) in;
+	zs.avail_in = csize;
+	zs.next_out = (unsigned char*) out;
+	zs.avail_out = usize + 1;
+
+	do {
+		ret = inflate(&zs, Z_FINISH);
+		if (ret == Z_STREAM_END && zs.avail_in)
+			ret = inflateReset(&zs);
+	} while (ret == Z_OK && zs.avail_in);
+
+	inflateEnd(&zs);
+
+	return ret == Z_STREAM_END &&
+	       (size_t) ((char*) zs.next_out - out) == usize ? 0 : -1;
+}
+
+/* inflate, cache and copy frames of a job until there are no more left */
+static void*
+job_worker(void *arg)
+{
+	struct job *job = arg;
+	struct seekable *sk = job->sk;
+	long long start, end;
+	size_t i, usize;
+	char *out;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next < job->last && !job->failed ? job->next++
+							   : (size_t) -1;
+		pthread_mutex_unlock(&job->lock);
+		if (i == (size_t) -1)
+			return NULL;
+
+		usize = sk->frames[i + 1].uoff - sk->frames[i].uoff;
+		if ((out = buf_alloc(usize + 1)) == NULL ||
+		    inflate_frame(sk, i, job->in + sk->frames[i].coff -
+				  sk->frames[job->first].coff, out)) {
+			buf_free(out, usize + 1);
+			pthread_mutex_lock(&job->lock);
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+			return NULL;
+		}
+
+		cache_put(job->key, i, out, usize);
+
+		/* copy the part of the frame the caller asked for */
+		start = sk->frames[i].uoff > job->off ? sk->frames[i].uoff
+						      : job->off;
+		end = sk->frames[i + 1].uoff < job->off + (long long) job->size
+		      ? sk->frames[i + 1].uoff : job->off + (long long) job->size;
+		if (end > start)
+			memcpy(job->buf + (start - job->off),
+			       out + (start - sk->frames[i].uoff), end - start);
+		buf_free(out, usize + 1);
+	}
+}
+
+/* job_worker() run by a helper, see tasks.c */
+static void
+job_task(void *arg)
+{
+	struct job *job = arg;
+
+	job_worker(job);
+
+	pthread_mutex_lock(&job->lock);
+	if (--job->helpers == 0)
+		pthread_cond_signal(&job->done);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* fetch frames [first, last) with a single request and inflate them */
+static int
+fetch_frames(struct lionfile *file, size_t first, size_t last, char *buf,
+	     size_t size, long long off)
+{
+	struct seekable *sk = file->seekable;
+	long long coff = sk->frames[first].coff;
+	size_t csize = sk->frames[last].coff - coff;
+	unsigned char key[CACHE_KEY_SIZE];
+	struct job job = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER,
+		.sk = sk,
+		.key = key,
+		.first = first,
+		.last = last,
+		.next = first,
+		.buf = buf,
+		.size = size,
+		.off = off,
+	};
+	struct task tasks[JOB_HELPERS];
+	int i, n, ntasks = 0;
+	void *in;
+
+	seekable_key(file, key);
+	mem_charge(MEM_INFLIGHT, csize);
+	/* `in` may come back another buffer, see mirror.c */
+	if ((in = buf_alloc(csize)) == NULL ||
+	    mirror_get_data(file->mirrors, file->nmirrors, csize, coff, &in)
+	    != csize) {
+		buf_free(in, csize);
+		mem_uncharge(MEM_INFLIGHT, csize);
+		return -1;
+	}
+	job.in = in;
+
+	/* the calling thread inflates too, helpers only for the rest */
+	n = task_max() < JOB_HELPERS ? task_max() : JOB_HELPERS;
+	if (n > (int) (last - first) - 1)
+		n = (int) (last - first) - 1;
+	for (; ntasks < n; ntasks++) {
+		tasks[ntasks].run = job_task;
+		tasks[ntasks].arg = &job;
+		pthread_mutex_lock(&job.lock);
+		job.helpers++;
+		pthread_mutex_unlock(&job.lock);
+		if (task_submit(&tasks[ntasks])) {
+			pthread_mutex_lock(&job.lock);
+			job.helpers--;
+			pthread_mutex_unlock(&job.lock);
+			break;
+		}
+	}
+
+	job_worker(&job);
+
+	/* helpers not started yet would find nothing left to do */
+	for (i = 0; i < ntasks; i++) {
+		if (task_cancel(&tasks[i]) == 0) {
+			pthread_mutex_lock(&job.lock);
+			job.helpers--;
+			pthread_mutex_unlock(&job.lock);
+		}
+	}
+	pthread_mutex_lock(&job.lock);
+	while (job.helpers)
+		pthread_cond_wait(&job.done, &job.lock);
+	pthread_mutex_unlock(&job.lock);
+
+	buf_free(in, csize);
+	mem_uncharge(MEM_INFLIGHT, csize);
+
+	return job.failed ? -1 : 0;
+}
+
+/**
+ * seekable_read() Read uncompressed data of a seekable link. Frames not
+ * cached are fetched, a run of consecutive missing frames in a single
+ * request. `off + size` must not be past the end of the data. Return the
+ * number of bytes read or -1 on error.
+ */
+size_t
+seekable_read(struct lionfile *file, char *buf, size_t size, long long off)
+{
+	struct seekable *sk = file->seekable;
+	unsigned char key[CACHE_KEY_SIZE];
+	size_t i, j, last, done = 0, ret, len, foff;
+
+	if (size == 0)
+		return 0;
+
+	seekable_key(file, key);
+	last = find_frame(sk, off + size - 1) + 1;
+
+	for (i = find_frame(sk, off); i < last; ) {
+		foff = off + done - sk->frames[i].uoff;
+		len = sk->frames[i + 1].uoff - (off + done);
+		if (len > size - done)
+			len = size - done;
+
+		ret = cache_get(key, i, foff, len, buf + done);
+		if (ret != (size_t) -1) {
+			done += ret;
+			i++;
+			continue;
+		}
+
+		for (j = i + 1; j < last && !cache_has(key, j); j++)
+			;
+
+		if (fetch_frames(file, i, j, buf + done, size - done,
+				 off + done))
+			return done ? done : (size_t) -1;
+
+		done = sk->frames[j].uoff < off + (long long) size
+		       ? (size_t) (sk->frames[j].uoff - off) : size;
+		i = j;
+	}
+
+	return done;
+}
@@ -0,0 +1,464 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cache shared by the lionfs mounts of a host.
+ *
+ * Blocks (see cache.h) are kept as files in a directory, named after their
+ * key and index, and published by renaming a complete temporary file. An
+ * index of the blocks present is mapped from a file in the same directory
+ * by every mount using it: a table of slots looked up without locks, where
+ * a slot is only a hint -- the data always comes from the block's file, so
+ * a stale slot is just a miss.
+ *
+ * When the blocks would take more than the size given to the first mount
+ * that created the directory, a clock sweep over the slots evicts blocks
+ * not hit since the last sweep. While a mount fetches a block, it holds an
+ * open file description lock on a byte of the index file standing for the
+ * block, so other mounts wanting it wait and then find it cached instead of
+ * fetching it again.
+ *
+ * A block file starts with the CRC32C of the block, computed when it was
+ * fetched, and the full key and index of the block: files and slots are
+ * only named after the first 64 bits of the key, so a block is served only
+ * if its header names the very block asked for. A block not matching its
+ * CRC is evicted and fetched again.
+ *
+ * Keys are derived from public data (see make_key()) and the CRC only
+ * catches damage, so any mount able to write the directory can publish a
+ * block other mounts will serve: mounts sharing it must trust each other.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "crc.h"
+#include "shared.h"
+
+#define SHARED_MAGIC 0x6c696f6e63616368ULL /* "lioncach" */
+#define SHARED_INDEX "index"
+#define BLOCK_MAGIC 0x326b626c /* "lbk2" */
+
+/* slots looked at for a block, starting from its hash */
+#define SHARED_PROBE 16
+
+/* fill locks are taken on bytes from here on, past the end of the index */
+#define SHARED_LOCK_BASE (1LL << 40)
+#define SHARED_LOCKS (1LL << 30)
+
+enum {
+	SLOT_EMPTY,
+	SLOT_BUSY, /* being filled or evicted */
+	SLOT_VALID,
+};
+
+struct slot {
+	uint32_t state;
+	uint32_t ref; /* hit since the last sweep */
+	uint32_t len;
+	uint32_t pad;
+	uint64_t key;
+	uint64_t index;
+};
+
+/* at the start of a block file */
+struct block_header {
+	uint32_t magic;
+	uint32_t crc;
+	uint64_t index;
+	unsigned char key[CACHE_KEY_SIZE];
+};
+
+struct header {
+	uint64_t magic;
+	uint64_t nslots; /* a power of two */
+	uint64_t limit;  /* bytes */
+	uint64_t bytes;  /* in block files */
+	uint64_t hand;   /* of the clock sweep */
+	struct slot slots[];
+};
+
+static char *dir; /* NULL if there's no shared cache */
+static int index_fd = -1;
+static struct header *table;
+static unsigned long long hits, published, corrupt, collisions;
+
+static inline uint64_t
+hash(unsigned long long key, unsigned long long index)
+{
+	return (key ^ (index * 0xff51afd7ed558ccdULL)) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* blocks are named and found by the first bytes of their key */
+static inline unsigned long long
+short_key(const unsigned char *key)
+{
+	unsigned long long k;
+
+	memcpy(&k, key, sizeof(k));
+	return k;
+}
+
+static void
+block_path(char *buf, size_t len, unsigned long long key,
+	   unsigned long long index)
+{
+	snprintf(buf, len, "%s/%02x/%016llx-%llx", dir, (unsigned) (key >> 56),
+		 key, index);
+}
+
+/* the slot a block is in, or NULL (lock-free, it may be stale) */
+static struct slot*
+find_slot(unsigned long long key, unsigned long long index)
+{
+	uint64_t h = hash(key, index), mask = table->nslots - 1;
+	struct slot *s;
+	int i;
+
+	for (i = 0; i < SHARED_PROBE; i++) {
+		s = &table->slots[(h + i) & mask];
+		if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SLOT_VALID &&
+		    s->key == key && s->index == index)
+			return s;
+	}
+
+	return NULL;
+}
+
+/* evict a valid slot, return 0 if it was ours to evict */
+static int
+evict(struct slot *s)
+{
+	uint32_t state = SLOT_VALID;
+	char path[PATH_MAX];
+
+	if (!__atomic_compare_exchange_n(&s->state, &state, SLOT_BUSY, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return -1;
+
+	block_path(path, sizeof(path), s->key, s->index);
+	unlink(path);
+	__atomic_sub_fetch(&table->bytes, s->len, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&s->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* sweep the clock until `len` more bytes fit (or a full turn is done) */
+static void
+make_room(size_t len)
+{
+	uint64_t i, n = table->nslots * 2;
+	struct slot *s;
+
+	for (i = 0; i < n && __atomic_load_n(&table->bytes, __ATOMIC_RELAXED)
+			     + len > table->limit; i++) {
+		s = &table->slots[__atomic_fetch_add(&table->hand, 1,
+						     __ATOMIC_RELAXED) &
+				  (table->nslots - 1)];
+		if (__atomic_load_n(&s->state, __ATOMIC_RELAXED) != SLOT_VALID)
+			continue;
+		if (__atomic_exchange_n(&s->ref, 0, __ATOMIC_RELAXED))
+			continue; /* second chance */
+		evict(s);
+	}
+}
+
+/* claim a slot for a block -- evicting one of its neighbours if needed */
+static struct slot*
+claim_slot(unsigned long long key, unsigned long long index)
+{
+	uint64_t h = hash(key, index), mask = table->nslots - 1;
+	uint32_t state;
+	struct slot *s, *victim = NULL;
+	int i, round;
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < SHARED_PROBE; i++) {
+			s = &table->slots[(h + i) & mask];
+			state = SLOT_EMPTY;
+			if (__atomic_compare_exchange_n(&s->state, &state,
+							SLOT_BUSY, 0,
+							__ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED))
+				return s;
+			if (!victim && state == SLOT_VALID &&
+			    !__atomic_load_n(&s->ref, __ATOMIC_RELAXED))
+				victim = s;
+		}
+
+		/* all neighbours taken, give the least useful one up */
+		if (evict(victim ? victim : &table->slots[h & mask]))
+			return NULL;
+		victim = NULL;
+	}
+
+	return NULL;
+}
+
+/* Tell whether a block seems to be in the shared cache (lock-free) */
+int
+shared_has(const unsigned char *key, unsigned long long index)
+{
+	return dir && find_slot(short_key(key), index);
+}
+
+/**
+ * shared_get() Copy a block from the shared cache to `buf` (CACHE_BLOCK
+ * bytes). Return its length or -1 if it isn't cached.
+ */
+size_t
+shared_get(const unsigned char *key, unsigned long long index, void *buf)
+{
+	char path[PATH_MAX];
+	struct block_header bh;
+	struct iovec iov[2] = {
+		{ .iov_base = &bh, .iov_len = sizeof(bh) },
+		{ .iov_base = buf, .iov_len = CACHE_BLOCK },
+	};
+	struct slot *s;
+	ssize_t len;
+	int fd;
+
+	if (!dir)
+		return -1;
+
+	if ((s = find_slot(short_key(key), index)) == NULL)
+		return -1;
+
+	block_path(path, sizeof(path), short_key(key), index);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		/* a stale slot, drop it so the block can be published again */
+		evict(s);
+		return -1;
+	}
+	len = preadv(fd, iov, 2, 0) - (ssize_t) sizeof(bh);
+	close(fd);
+
+	if (len <= 0 || bh.magic != BLOCK_MAGIC ||
+	    bh.crc != crc32c(0, buf, len)) {
+		/* damaged on disk, or written by an incompatible version */
+		if (len >= 0)
+			__atomic_add_fetch(&corrupt, 1, __ATOMIC_RELAXED);
+		evict(s);
+		return -1;
+	}
+	if (bh.index != index || memcmp(bh.key, key, CACHE_KEY_SIZE)) {
+		/* another block with the same short key, not ours to serve */
+		__atomic_add_fetch(&collisions, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	__atomic_store_n(&s->ref, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+	return len;
+}
+
+/* Publish a block in the shared cache -- silently skipped on errors */
+void
+shared_put(const unsigned char *key, unsigned long long index, const void *data,
+	   size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct block_header bh = { .magic = BLOCK_MAGIC, .index = index };
+	struct iovec iov[2] = {
+		{ .iov_base = &bh, .iov_len = sizeof(bh) },
+		{ .iov_base = (void*) data, .iov_len = len },
+	};
+	struct slot *s;
+	int fd;
+
+	if (!dir || find_slot(short_key(key), index))
+		return;
+
+	make_room(len);
+	if ((s = claim_slot(short_key(key), index)) == NULL)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", dir);
+	if ((fd = mkstemp(tmp)) == -1)
+		goto error;
+	bh.crc = crc32c(0, data, len);
+	memcpy(bh.key, key, CACHE_KEY_SIZE);
+	if (writev(fd, iov, 2) != (ssize_t) (sizeof(bh) + len)) {
+		close(fd);
+		unlink(tmp);
+		goto error;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+
+	block_path(path, sizeof(path), short_key(key), index);
+	*strrchr(path, '/') = '\0';
+	mkdir(path, 0755);
+	block_path(path, sizeof(path), short_key(key), index);
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto error;
+	}
+
+	s->key = short_key(key);
+	s->index = index;
+	s->len = len;
+	s->ref = 0;
+	__atomic_add_fetch(&table->bytes, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->state, SLOT_VALID, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&published, 1, __ATOMIC_RELAXED);
+	return;
+
+error:
+	__atomic_store_n(&s->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+}
+
+static void
+fill_lock(unsigned long long key, unsigned long long index, short type)
+{
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = SHARED_LOCK_BASE + hash(key, index) % SHARED_LOCKS,
+		.l_len = 1,
+	};
+
+	while (fcntl(index_fd, F_OFD_SETLKW, &fl) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Announce we're fetching a block, waiting for another mount fetching it --
+ * recheck the shared cache after this
+ */
+void
+shared_lock(const unsigned char *key, unsigned long long index)
+{
+	if (dir)
+		fill_lock(short_key(key), index, F_WRLCK);
+}
+
+void
+shared_unlock(const unsigned char *key, unsigned long long index)
+{
+	if (dir)
+		fill_lock(short_key(key), index, F_UNLCK);
+}
+
+int
+shared_print(char *buf, size_t len)
+{
+	int n;
+
+	if (!dir)
+		return 0;
+
+	n = snprintf(buf, len, "shared.hits %llu\nshared.published %llu\n"
+		     "shared.corrupt %llu\nshared.collisions %llu\n"
+		     "shared.bytes %llu\nshared.limit %llu\n",
+		     __atomic_load_n(&hits, __ATOMIC_RELAXED),
+		     __atomic_load_n(&published, __ATOMIC_RELAXED),
+		     __atomic_load_n(&corrupt, __ATOMIC_RELAXED),
+		     __atomic_load_n(&collisions, __ATOMIC_RELAXED),
+		     (unsigned long long)
+		     __atomic_load_n(&table->bytes, __ATOMIC_RELAXED),
+		     (unsigned long long) table->limit);
+
+	return (size_t) n < len ? n : (int) len;
+}
+
+/**
+ * shared_init() Use the shared cache in `path`, creating it if needed with
+ * room for `limit` bytes of blocks. Return 0 or -1 on error.
+ */
+int
+shared_init(const char *path, unsigned long long limit)
+{
+	char index_path[PATH_MAX];
+	struct header header;
+	uint64_t nslots = 1024;
+	size_t size;
+	struct stat st;
+
+	/* absolute, FUSE changes to / when it runs in the background */
+	mkdir(path, 0755);
+	if ((dir = realpath(path, NULL)) == NULL)
+		return -1;
+	snprintf(index_path, sizeof(index_path), "%s/" SHARED_INDEX, dir);
+	if ((index_fd = open(index_path, O_RDWR | O_CREAT, 0644)) == -1)
+		goto error_path;
+
+	/* the first mount to get here sets the index up */
+	flock(index_fd, LOCK_EX);
+
+	if (fstat(index_fd, &st) == -1)
+		goto error_unlock;
+
+	if (st.st_size == 0) {
+		/* twice the slots the blocks can take, the table stays sparse */
+		while (nslots < limit / CACHE_BLOCK * 2)
+			nslots <<= 1;
+		size = sizeof(struct header) + nslots * sizeof(struct slot);
+
+		memset(&header, 0, sizeof(header));
+		header.magic = SHARED_MAGIC;
+		header.nslots = nslots;
+		header.limit = limit;
+		if (ftruncate(index_fd, size) == -1 ||
+		    pwrite(index_fd, &header, sizeof(header), 0)
+		    != sizeof(header))
+			goto error_unlock;
+	} else if (pread(index_fd, &header, sizeof(header), 0)
+		   != sizeof(header) || header.magic != SHARED_MAGIC ||
+		   (header.nslots & (header.nslots - 1)) ||
+		   (size = sizeof(struct header) +
+			   header.nslots * sizeof(struct slot))
+		   > (size_t) st.st_size) {
+		goto error_unlock;
+	}
+
+	flock(index_fd, LOCK_UN);
+
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd,
+		     0);
+	if (table == MAP_FAILED)
+		goto error;
+
+	return 0;
+
+error_unlock:
+	flock(index_fd, LOCK_UN);
+error:
+	close(index_fd);
+	index_fd = -1;
+error_path:
+	free(dir);
+	dir = NULL;
+	return -1;
+}
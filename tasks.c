@@ -0,0 +1,190 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Helper threads.
+ *
+ * Work split across CPUs (the frames of a seekable read, see seekable.c) is
+ * handed to helper threads kept for the life of the mount, instead of to
+ * threads created and joined for each read. Helpers are started while more
+ * tasks are queued than helpers are idle, up to one less than the CPUs (the
+ * thread submitting them works too) and TASK_MAX_HELPERS, and then wait for
+ * more tasks.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tasks.h"
+
+#define TASK_MAX_HELPERS 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct task *head, **tail = &head;
+static int queued, helpers, idle;
+static int max_helpers = -1;
+static unsigned long long done;
+
+static void*
+helper_thread(void *arg)
+{
+	struct task *t;
+
+	(void) arg;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!head) {
+			idle++;
+			pthread_cond_wait(&cond, &lock);
+			idle--;
+		}
+		t = head;
+		if ((head = t->next) == NULL)
+			tail = &head;
+		t->queued = 0;
+		queued--;
+		pthread_mutex_unlock(&lock);
+
+		/* the task may be gone once it has run */
+		t->run(t->arg);
+
+		pthread_mutex_lock(&lock);
+		done++;
+	}
+
+	return NULL;
+}
+
+/* *assume lock is held */
+static int
+start_helper(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* signals are left to the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&thread, &attr, helper_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0)
+		return -1;
+
+	helpers++;
+	return 0;
+}
+
+/* Number of helpers there can be, 0 if tasks are never run by them */
+int
+task_max(void)
+{
+	long cpus;
+
+	pthread_mutex_lock(&lock);
+	if (max_helpers < 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		max_helpers = cpus - 1 < TASK_MAX_HELPERS
+			      ? (cpus > 1 ? cpus - 1 : 0) : TASK_MAX_HELPERS;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return max_helpers;
+}
+
+/**
+ * task_submit() Have `task->run(task->arg)` run by a helper. Return 0 if it
+ * is queued, or -1 if there's no helper to run it.
+ */
+int
+task_submit(struct task *task)
+{
+	int max = task_max();
+
+	pthread_mutex_lock(&lock);
+
+	if (queued >= idle && helpers < max)
+		start_helper();
+	if (helpers == 0) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	task->next = NULL;
+	task->queued = 1;
+	*tail = task;
+	tail = &task->next;
+	queued++;
+	pthread_cond_signal(&cond);
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+/**
+ * task_cancel() Take a task no helper has started yet off the queue. Return
+ * 0 if it was, or -1 if it is running or has run.
+ */
+int
+task_cancel(struct task *task)
+{
+	struct task **t;
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+
+	if (task->queued) {
+		for (t = &head; *t != task; t = &(*t)->next)
+			;
+		if ((*t = task->next) == NULL)
+			tail = t;
+		task->queued = 0;
+		queued--;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int
+task_print(char *buf, size_t len)
+{
+	int n;
+
+	pthread_mutex_lock(&lock);
+	n = snprintf(buf, len, "tasks.helpers %d\ntasks.idle %d\n"
+		     "tasks.done %llu\n", helpers, idle, done);
+	pthread_mutex_unlock(&lock);
+
+	return (size_t) n < len ? n : (int) len;
+}
@@ -0,0 +1,90 @@
+/*
+ * lionfs, The Link Over Network File System
+ * Copyright (C) 2026  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Directory index: children keep their slot while they live and freed
+ * slots are reused, see dir.c.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../dir.h"
+#include "../lionfs.h"
+
+static lionfile_t a = { .name = "a" }, b = { .name = "b" }, c = { .name = "c" };
+
+/* a freed slot comes back, then a new one -- never past the array */
+static void
+test_reuse(void)
+{
+	struct liondir *dir = dir_new();
+	size_t slot = 0;
+
+	assert(dir);
+	assert(dir_add(dir, &a) == 0 && a.slot == 0);
+	dir_del(dir, &a);
+	assert(dir_add(dir, &b) == 0 && b.slot == 0);
+	assert(dir_add(dir, &c) == 0 && c.slot == 1);
+
+	assert(dir_next(dir, &slot) == &b && slot == 0);
+	slot++;
+	assert(dir_next(dir, &slot) == &c && slot == 1);
+	slot++;
+	assert(dir_next(dir, &slot) == NULL);
+
+	assert(dir_lookup(dir, "a", 1) == NULL);
+	assert(dir_lookup(dir, "c", 1) == &c);
+
+	dir_del(dir, &b);
+	dir_del(dir, &c);
+	dir_free(dir);
+}
+
+/* freed slots are handed out again last freed first */
+static void
+test_free_list(void)
+{
+	struct liondir *dir = dir_new();
+
+	assert(dir);
+	assert(dir_add(dir, &a) == 0 && dir_add(dir, &b) == 0 &&
+	       dir_add(dir, &c) == 0);
+	dir_del(dir, &a);
+	dir_del(dir, &c);
+	assert(dir_add(dir, &c) == 0 && c.slot == 2);
+	assert(dir_add(dir, &a) == 0 && a.slot == 0);
+
+	dir_del(dir, &a);
+	dir_del(dir, &b);
+	dir_del(dir, &c);
+	dir_free(dir);
+}
+
+int
+main(void)
+{
+	test_reuse();
+	test_free_list();
+
+	printf("dir_test: ok\n");
+	return 0;
+}